@@ -24,6 +24,7 @@
 #include <pthread.h>
 #include <time.h>
 #include <semaphore.h>
+#include <poll.h>
 #include "../hm11_lkm/hm11_ioctl.h"
 #include "queue.h"
 
@@ -47,7 +48,7 @@ struct client_thread_t
 };
 
 static char terminated = 0;
-static char heart_rate;
+static uint8_t heart_rate;
 //Linked list of threads
 pthread_mutex_t list_mutex = PTHREAD_MUTEX_INITIALIZER; 
 SLIST_HEAD(head_s, client_thread_t) head;
@@ -183,13 +184,13 @@ static void *handle_client(void *client_info)
         client_info_parsed->new_value_available = 0;
 
         //Get the value
-        char heart_rate_value = heart_rate;
+        uint8_t heart_rate_value = heart_rate;
 
         //Send it to the client
         int sent_bytes = 0;
         while(sent_bytes != 1)
         {
-            sent_bytes = send(client_info_parsed->socket_client, &heart_rate_value, sizeof(char), 0);
+            sent_bytes = send(client_info_parsed->socket_client, &heart_rate_value, sizeof(heart_rate_value), 0);
             if(sent_bytes == -1)
                 goto terminate_client;
         }
@@ -510,17 +511,30 @@ int main(int c, char **argv)
         return 1;  
     }
 
-    //At this point, notification values will be received by the drivers; read most recent every 2s
+    //At this point, notification values are collected by the driver; wait for each one as it arrives.
+    //The timeout only bounds how long it takes to notice termination
+    struct pollfd hm11_poll = {.fd = hm11_dev, .events = POLLIN};
     while(!terminated)
     {
-        sleep(2);
-        ret = ioctl(hm11_dev, HM11_READ_NOTIFIED, &heart_rate);
-        if(ret)
+        struct hm11_sample sample;
+        ret = poll(&hm11_poll, 1, 1000);
+        if(ret <= 0)
         {
-            printf("Could not read notified heart rate value: %d, %s\n", ret, strerror(ret));
+            continue;
+        }
+        ret = read(hm11_dev, &sample, sizeof(sample));
+        if(ret != sizeof(sample))
+        {
+            printf("Could not read notified heart rate value: %d, %s\n", ret, strerror(errno));
+            if(ret == 0)
+            {
+                //The subscription is gone, there will be no more samples
+                break;
+            }
         }
         else
         {
+            heart_rate = sample.value;
             //Update the flag on every existing thread
             struct client_thread_t *element = NULL;
             struct client_thread_t *tmp = NULL;
@@ -543,7 +557,7 @@ int main(int c, char **argv)
             }
             else
             {
-                printf("The current heart rate is: %d\n", heart_rate);
+                printf("The current heart rate is: %u\n", heart_rate);
             }
             ret = pthread_mutex_unlock(&list_mutex);
             if(ret != 0)
@@ -16,9 +16,40 @@
 #include <asm/uaccess.h>
 #include <linux/slab.h>
 #include <linux/mutex.h>
+#include <linux/moduleparam.h>
+#include <linux/err.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
 #include "hm11_ioctl.h"
+#include "../uart_driver/uart_driver.h"
+
+#define CREATE_TRACE_POINTS
+#include "hm11_trace.h"
 
 #define HEART_RATE_ID   (0x16)
+//Samples kept for the readers, a power of two
+#define SAMPLE_RING_SIZE    (256)
+//Samples copied to user space per pass of hm11_read()
+#define SAMPLE_READ_BATCH   (16)
+
+//Longest argument of a response token, a device name or a service/characteristic line, plus the NUL
+#define HM11_ARG_MAX                (64)
+//Address type, ':' and 12 MAC characters following OK+DIS
+#define HM11_ADDR_LEN               (2 + MAC_SIZE)
+//Bytes taken from the UART per call while waiting for a response
+#define HM11_CHUNK_SIZE             (64)
+//Extra bytes allocated whenever a response string has to grow
+#define HM11_STR_CHUNK              (35)
+//Silence after which a token that a longer one could still extend ("OK", "OK+CONN") is taken as complete.
+//About 20 character times at 9600 baud
+#define HM11_IDLE_MS                (20)
+//Time allowed for the complete response, counted from the command
+#define HM11_COMMAND_TIMEOUT_MS     (1000)
+#define HM11_CONNECT_TIMEOUT_MS     (10000)
+#define HM11_DISCOVERY_TIMEOUT_MS   (15000)
+#define HM11_LIST_TIMEOUT_MS        (5000)
 
 MODULE_AUTHOR("Jordi Cros Mompart");
 MODULE_LICENSE("Dual BSD/GPL");
@@ -27,11 +58,187 @@ static int hm11_major =   0; // use dynamic major
 static int hm11_minor =   0;
 static struct cdev cdev;
 
-static ssize_t hm11_transmit(char *buf, size_t len);
-static ssize_t variable_wait_limited(char *buf, size_t len, size_t timeout);
+//Responses of the HM-11, as reported by the parser
+enum hm11_event_type
+{
+    HM11_EV_OK,
+    HM11_EV_WAKE,
+    HM11_EV_LOST,
+    HM11_EV_CONN,
+    HM11_EV_CONNA,
+    HM11_EV_CONNE,
+    HM11_EV_CONNF,
+    HM11_EV_SEND_OK,
+    HM11_EV_SEND_ER,
+    HM11_EV_DATA_OK,
+    HM11_EV_DATA_ER,
+    //arg is the value set
+    HM11_EV_SET,
+    HM11_EV_RESET,
+    HM11_EV_DISCS,
+    HM11_EV_DISCE,
+    //arg is "[ADDRTYPE]:[MAC]"
+    HM11_EV_DEVICE,
+    //arg is the device name
+    HM11_EV_NAME,
+    //A run of '*' framing a service or characteristic list
+    HM11_EV_RULE,
+    //arg is one line between two rules
+    HM11_EV_LINE,
+};
+
+//What follows the fixed text of a token
+enum hm11_arg_kind
+{
+    HM11_ARG_NONE,
+    //Everything up to the line end
+    HM11_ARG_LINE,
+    //Everything up to the line end or a short silence, the HM-11 does not always end it
+    HM11_ARG_VALUE,
+    //HM11_ADDR_LEN characters, the rest of the line is skipped
+    HM11_ARG_ADDR,
+    //Any number of further '*'
+    HM11_ARG_STARS,
+};
+
+struct hm11_token
+{
+    const char *text;
+    enum hm11_event_type type;
+    enum hm11_arg_kind arg;
+};
+
+//Every response token. Sorted by text, so the tokens sharing a prefix are next to each other and
+//a token comes right before the ones extending it. Only tokens without an argument may be extended,
+//OK+DIS being the exception: an address type is never 'C'
+static const struct hm11_token hm11_tokens[] = {
+    {"*",           HM11_EV_RULE,       HM11_ARG_STARS},
+    {"OK",          HM11_EV_OK,         HM11_ARG_NONE},
+    {"OK+CONN",     HM11_EV_CONN,       HM11_ARG_NONE},
+    {"OK+CONNA",    HM11_EV_CONNA,      HM11_ARG_NONE},
+    {"OK+CONNE",    HM11_EV_CONNE,      HM11_ARG_NONE},
+    {"OK+CONNF",    HM11_EV_CONNF,      HM11_ARG_NONE},
+    {"OK+DATA-ER",  HM11_EV_DATA_ER,    HM11_ARG_NONE},
+    {"OK+DATA-OK",  HM11_EV_DATA_OK,    HM11_ARG_NONE},
+    {"OK+DIS",      HM11_EV_DEVICE,     HM11_ARG_ADDR},
+    {"OK+DISCE",    HM11_EV_DISCE,      HM11_ARG_NONE},
+    {"OK+DISCS",    HM11_EV_DISCS,      HM11_ARG_NONE},
+    {"OK+LOST",     HM11_EV_LOST,       HM11_ARG_NONE},
+    {"OK+NAME:",    HM11_EV_NAME,       HM11_ARG_LINE},
+    {"OK+RESET",    HM11_EV_RESET,      HM11_ARG_NONE},
+    {"OK+SEND-ER",  HM11_EV_SEND_ER,    HM11_ARG_NONE},
+    {"OK+SEND-OK",  HM11_EV_SEND_OK,    HM11_ARG_NONE},
+    {"OK+Set:",     HM11_EV_SET,        HM11_ARG_VALUE},
+    {"OK+WAKE",     HM11_EV_WAKE,       HM11_ARG_NONE},
+};
+
+struct hm11_event
+{
+    enum hm11_event_type type;
+    //NUL-terminated, len bytes
+    char arg[HM11_ARG_MAX];
+    size_t len;
+};
+
+//Called for every token of a response, returns true once the response is complete
+typedef bool (*hm11_event_fn)(void *ctx, const struct hm11_event *ev);
+
+//Incremental response parser, fed with whatever chunks the UART returns.
+//Bytes no token starts with, and partial tokens no token continues, are counted in garbage
+//and skipped; matching starts over at the first byte that does not fit
+struct hm11_parser
+{
+    enum
+    {
+        HM11_PARSE_TOKEN,
+        HM11_PARSE_ARG,
+        HM11_PARSE_SKIP_LINE,
+    } state;
+    //First entry of hm11_tokens matching the bytes seen so far, and their number
+    unsigned int cand;
+    unsigned int matched;
+    //Set between the two rules of a service or characteristic list
+    bool listing;
+    struct hm11_event ev;
+    unsigned long garbage;
+    //Set when the byte completing the last token was not part of it, e.g. the one after "OK+SEND-OK"
+    bool unconsumed;
+};
+
+//Result of a command when the given token arrives. arg 0 matches any argument,
+//anything else a single character argument
+struct hm11_reply
+{
+    enum hm11_event_type type;
+    char arg;
+    long result;
+};
+
+//Context of hm11_expect()
+struct hm11_expect
+{
+    const struct hm11_reply *replies;
+    size_t num_replies;
+    long result;
+};
+
+//Context of collect_devices() and collect_lines()
+struct hm11_collect
+{
+    struct hm11_ioctl_str *buf;
+    size_t used;
+    bool started;
+    ssize_t ret;
+};
+
+//Names of the hm11_event_type values, for the hm11_token tracepoint
+static const char *const hm11_event_names[] = {
+    [HM11_EV_OK] = "OK",
+    [HM11_EV_WAKE] = "WAKE",
+    [HM11_EV_LOST] = "LOST",
+    [HM11_EV_CONN] = "CONN",
+    [HM11_EV_CONNA] = "CONNA",
+    [HM11_EV_CONNE] = "CONNE",
+    [HM11_EV_CONNF] = "CONNF",
+    [HM11_EV_SEND_OK] = "SEND-OK",
+    [HM11_EV_SEND_ER] = "SEND-ER",
+    [HM11_EV_DATA_OK] = "DATA-OK",
+    [HM11_EV_DATA_ER] = "DATA-ER",
+    [HM11_EV_SET] = "SET",
+    [HM11_EV_RESET] = "RESET",
+    [HM11_EV_DISCS] = "DISCS",
+    [HM11_EV_DISCE] = "DISCE",
+    [HM11_EV_DEVICE] = "DEVICE",
+    [HM11_EV_NAME] = "NAME",
+    [HM11_EV_RULE] = "RULE",
+    [HM11_EV_LINE] = "LINE",
+};
+
+//Replies to AT+NOTIFY_ON and AT+NOTIFYOFF
+static const struct hm11_reply notify_replies[] = {
+    {HM11_EV_SEND_OK, 0, 0},
+    {HM11_EV_DATA_OK, 0, 0},
+    {HM11_EV_SEND_ER, 0, -ENODEV},
+    {HM11_EV_DATA_ER, 0, -ENODEV},
+};
+
+static ssize_t hm11_transmit(const char *buf, size_t len);
 static ssize_t reallocate_memory_if(int condition,struct hm11_ioctl_str *buf,size_t packet_length);
-static ssize_t parse_response_by_delimiter_char(size_t unit_length,struct hm11_ioctl_str *buf);
-static ssize_t parse_device_discovery_response(void);
+static ssize_t append_to_str(struct hm11_ioctl_str *buf, size_t *used, const char *src, size_t len);
+
+static void hm11_parse_reset(struct hm11_parser *p);
+static bool hm11_parse_emit(struct hm11_parser *p, enum hm11_event_type type, hm11_event_fn fn, void *ctx);
+static void hm11_parse_append(struct hm11_parser *p, char c);
+static bool hm11_parse_byte(struct hm11_parser *p, char c, hm11_event_fn fn, void *ctx);
+static bool hm11_parse(struct hm11_parser *p, const char *buf, size_t len, size_t *used, hm11_event_fn fn, void *ctx);
+static bool hm11_parse_pending(const struct hm11_parser *p);
+static bool hm11_parse_flush(struct hm11_parser *p, hm11_event_fn fn, void *ctx);
+static ssize_t hm11_command(const char *cmd, size_t len, hm11_event_fn fn, void *ctx, unsigned int timeout);
+static bool hm11_expect(void *ctx, const struct hm11_event *ev);
+static long hm11_command_expect(const char *cmd, size_t len, const struct hm11_reply *replies, size_t num_replies, unsigned int timeout);
+static bool collect_devices(void *ctx, const struct hm11_event *ev);
+static bool collect_lines(void *ctx, const struct hm11_event *ev);
+static ssize_t hm11_list(const char *cmd, size_t len, struct hm11_ioctl_str *buf);
 
 static ssize_t hm11_echo(void);
 static void hm11_mac_read(char *str);
@@ -50,6 +257,10 @@ static ssize_t hm11_set_role(char *str);
 static void hm11_sleep(void);
 static ssize_t hm11_read_notified(void);
 
+static int hm11_ingest_start(void);
+static void hm11_ingest_stop(void);
+static void hm11_ingest(void *priv, const char *buf, size_t len, ktime_t arrival);
+
 struct mutex hm11_protect;
 static size_t devices_str_num_chars_to_copy = 0;
 static struct hm11_ioctl_str devices = {NULL,0};
@@ -59,10 +270,33 @@ static size_t characteristics_str_num_chars_to_copy = 0;
 static struct hm11_ioctl_str characteristics = {NULL,0};
 
 
-extern ssize_t uart_send(const char *buf, size_t size);
-extern ssize_t uart_receive(char *buf, size_t size);
-extern ssize_t uart_receive_timeout(char *buf, size_t size,int msecs);
-extern void uart_flush_buffer(void);
+//UART the HM-11 is wired to, claimed at module load
+static char *uart_name = "uart1";
+module_param(uart_name, charp, S_IRUGO);
+MODULE_PARM_DESC(uart_name, "uart_serial device the HM-11 is connected to (uart1, uart4 or uart5)");
+static struct uart_serial_dev *uart;
+
+//Notifications parsed in the background while subscribed. head and tail are free running,
+//the oldest sample is overwritten when the ring is full
+static struct hm11_sample samples[SAMPLE_RING_SIZE];
+static unsigned int samples_head;
+static unsigned int samples_tail;
+static u32 samples_seq;
+static unsigned long samples_overwritten;
+//Sequence number of the last sample returned by HM11_READ_NOTIFIED
+static u32 samples_notified_seq;
+static DEFINE_SPINLOCK(samples_lock);
+//Readers waiting for samples
+static DECLARE_WAIT_QUEUE_HEAD(samples_waitQ);
+//Set if hm11_ingest() is registered as the RX handler of the UART
+static bool ingesting;
+//Set by hm11_ingest() when the last byte seen was HEART_RATE_ID
+static bool heart_rate_id_seen;
+//Bytes received behind the token completing the last command, and their arrival time.
+//Notifications may follow the confirmation of AT+NOTIFY_ON in the same burst
+static char rx_leftover[HM11_CHUNK_SIZE];
+static size_t rx_leftover_len;
+static ktime_t rx_leftover_time;
 
 
 int hm11_open(struct inode *inode, struct file *filp)
@@ -73,7 +307,7 @@ int hm11_open(struct inode *inode, struct file *filp)
         printk("hm11: Device not available\n");
         return -ENODEV;
     }
-    printk("hm11: Module open\n");
+    pr_debug("hm11: Module open\n");
     try_module_get(THIS_MODULE);
 
     return 0;
@@ -82,8 +316,9 @@ int hm11_open(struct inode *inode, struct file *filp)
 int hm11_release(struct inode *inode, struct file *filp)
 {
     //Handle close
-    printk("hm11: Module released\n");
-    uart_flush_buffer();
+    pr_debug("hm11: Module released\n");
+    hm11_ingest_stop();
+    uart_flush_buffer(uart);
     if(services.str_len)
     {
         kfree(services.str);
@@ -108,15 +343,79 @@ int hm11_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
+/*
+*   Returns as many whole struct hm11_sample records as are in the ring and fit in count bytes,
+*   oldest first. Blocks until there is at least one, unless O_NONBLOCK is set.
+*   Returns 0 (end of file) once the ring is empty and no notification is subscribed.
+*/
 ssize_t hm11_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
 {
-    printk("hm11: Read still to be developed\n");
-    return 0;
+    struct hm11_sample batch[SAMPLE_READ_BATCH];
+    size_t wanted = count / sizeof(struct hm11_sample);
+    size_t copied = 0;
+    int ret;
+    if(!wanted)
+    {
+        return -EINVAL;
+    }
+    spin_lock(&samples_lock);
+    while(samples_head == samples_tail && READ_ONCE(ingesting))
+    {
+        spin_unlock(&samples_lock);
+        if(filp->f_flags & O_NONBLOCK)
+        {
+            return -EAGAIN;
+        }
+        ret = wait_event_interruptible(samples_waitQ, samples_head != samples_tail || !READ_ONCE(ingesting));
+        if(ret)
+        {
+            return ret;
+        }
+        spin_lock(&samples_lock);
+    }
+    while(copied < wanted && samples_head != samples_tail)
+    {
+        //copy_to_user may fault, so every batch is taken out of the ring first
+        size_t n = 0;
+        while(n < SAMPLE_READ_BATCH && copied + n < wanted && samples_head != samples_tail)
+        {
+            batch[n++] = samples[samples_tail++ & (SAMPLE_RING_SIZE - 1)];
+        }
+        spin_unlock(&samples_lock);
+        if(copy_to_user(&buf[copied * sizeof(struct hm11_sample)], batch, n * sizeof(struct hm11_sample)))
+        {
+            return copied ? copied * sizeof(struct hm11_sample) : -EFAULT;
+        }
+        copied += n;
+        spin_lock(&samples_lock);
+    }
+    spin_unlock(&samples_lock);
+    return copied * sizeof(struct hm11_sample);
+}
+
+/*
+*   POLLIN while samples are waiting, POLLHUP once the ring is empty and no notification is subscribed.
+*/
+static __poll_t hm11_poll(struct file *filp, poll_table *wait)
+{
+    __poll_t mask = 0;
+    poll_wait(filp, &samples_waitQ, wait);
+    spin_lock(&samples_lock);
+    if(samples_head != samples_tail)
+    {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    else if(!READ_ONCE(ingesting))
+    {
+        mask |= EPOLLHUP;
+    }
+    spin_unlock(&samples_lock);
+    return mask;
 }
 
 ssize_t hm11_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
 {
-    printk("hm11: Write still to be developed\n");
+    pr_debug("hm11: Write still to be developed\n");
     return count;
 }
 
@@ -136,7 +435,7 @@ long hm11_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     switch(cmd)
     {
     case HM11_ECHO:
-        printk("hm11: Performing echo...\n");
+        pr_debug("hm11: Performing echo...\n");
         res = hm11_echo();
         if(res < 0)
         {
@@ -153,7 +452,7 @@ long hm11_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
         break;
     case HM11_MAC_RD:
-        printk("hm11: Reading MAC address...\n");
+        pr_debug("hm11: Reading MAC address...\n");
 
         str = kmalloc(sizeof(char)*MAC_SIZE_STR, GFP_KERNEL);
         if(!str)
@@ -175,7 +474,7 @@ long hm11_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         free_mac_read: kfree(str);
         break;
     case HM11_MAC_WR:
-        printk("hm11: Modifying MAC address...\n");
+        pr_debug("hm11: Modifying MAC address...\n");
         str = kmalloc(sizeof(char)*MAC_SIZE_STR, GFP_KERNEL);
         if(!str)
             return -ENOMEM;
@@ -202,13 +501,13 @@ long hm11_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         free_mac_wr: kfree(str);
         break;
     case HM11_CONN_LAST_DEVICE:
-        printk("hm11: Connecting to last successfully paired device...\n");
+        pr_debug("hm11: Connecting to last successfully paired device...\n");
         res = hm11_connect_last();
         //TODO: Parse retval according to what is defined in hm11_ioctl.h
 
         break;
     case HM11_CONN_MAC:
-        printk("hm11: Connecting to the provided MAC address...\n");
+        pr_debug("hm11: Connecting to the provided MAC address...\n");
         str = kmalloc(sizeof(char)*MAC_SIZE_STR, GFP_KERNEL);
         if(!str)
             return -ENOMEM;
@@ -296,7 +595,7 @@ long hm11_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         }
         break;
     case HM11_SERVICE_DISCOVER:
-        printk("hm11: Performing service discovery on the connected device...\n");
+        pr_debug("hm11: Performing service discovery on the connected device...\n");
 
         if(!service_str_num_chars_to_copy)
         {
@@ -323,7 +622,7 @@ long hm11_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
         break;
     case HM11_CHARACTERISTIC_DISCOVER_PROBE:
-        printk("hm11: Device discovery request\n");
+        pr_debug("hm11: Device discovery request\n");
         res = hm11_characteristics_probe();
         if(res < 0)
         {
@@ -340,7 +639,7 @@ long hm11_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         }
         break;
     case HM11_CHARACTERISTIC_DISCOVER:
-        printk("hm11: Performing characteristic discovery on the connected device...\n");
+        pr_debug("hm11: Performing characteristic discovery on the connected device...\n");
 
         if(!characteristics_str_num_chars_to_copy)
         {
@@ -367,7 +666,7 @@ long hm11_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
         break;
     case HM11_CHARACTERISTIC_NOTIFY:
-        printk("hm11: Subscribing to a characteristic notification...\n");
+        pr_debug("hm11: Subscribing to a characteristic notification...\n");
         str = kmalloc(sizeof(char)*CHARACTERISTIC_SIZE_STR, GFP_KERNEL);
         if(!str)
         {
@@ -393,6 +692,10 @@ long hm11_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
         ret_val = hm11_characteristic_notify(str);
         //TODO: Parse retval according to what is defined in hm11_ioctl.h
+        if(ret_val == 0)
+        {
+            ret_val = hm11_ingest_start();
+        }
 
         //Free the used space
         free_mem_notif_on:
@@ -400,7 +703,7 @@ long hm11_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
         break;
     case HM11_CHARACTERISTIC_NOTIFY_OFF:
-        printk("hm11: Stopping subscription to a characteristic notification...\n");
+        pr_debug("hm11: Stopping subscription to a characteristic notification...\n");
         str = kmalloc(sizeof(char)*CHARACTERISTIC_SIZE_STR, GFP_KERNEL);
         if(!str)
             return -ENOMEM;
@@ -430,12 +733,12 @@ long hm11_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
         break;
     case HM11_PASSIVE:
-        printk("hm11: Setting deice to passive mode...\n");
+        pr_debug("hm11: Setting deice to passive mode...\n");
         ret_val = hm11_passive();
 
         break;
     case HM11_NAME:
-        printk("hm11: Modifying device name...\n");
+        pr_debug("hm11: Modifying device name...\n");
         str = kmalloc(sizeof(char)*MAX_NAME_LEN, GFP_KERNEL);
         if(!str)
             return -ENOMEM;
@@ -456,18 +759,18 @@ long hm11_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             goto free_hm11_name;   
         }
 
-        printk("User-space string: %s", str);
+        pr_debug("hm11: User-space string: %s\n", str);
         hm11_set_name(str);
 
         //Free the used space
         free_hm11_name: kfree(str);
         break;
     case HM11_DEFAULT:
-        printk("hm11: Performing device reset to defaults...\n");
+        pr_debug("hm11: Performing device reset to defaults...\n");
         ret_val = hm11_reset();
         break;
     case HM11_ROLE:
-        printk("hm11: Modifying device role...\n");
+        pr_debug("hm11: Modifying device role...\n");
         str = kmalloc(sizeof(char), GFP_KERNEL);
         if(!str)
             return -ENOMEM;
@@ -501,12 +804,12 @@ long hm11_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
         break;
     case HM11_SLEEP:
-        printk("hm11: Jumping to sleep mode...\n");
+        pr_debug("hm11: Jumping to sleep mode...\n");
         hm11_sleep();
 
         break;
     case HM11_READ_NOTIFIED:
-        printk("hm11: Reading most recent notified value...\n");
+        pr_debug("hm11: Reading most recent notified value...\n");
         res = hm11_read_notified();
 
         if(res < 0)
@@ -539,6 +842,7 @@ long hm11_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 struct file_operations hm11_fops = {
     .owner =    THIS_MODULE,
     .read =     hm11_read,
+    .poll =     hm11_poll,
     .write =    hm11_write,
     .open =     hm11_open,
     .release =  hm11_release,
@@ -550,11 +854,18 @@ int hm11_init_module(void)
     int err, devno;
     dev_t dev = 0;
     int result;
+    uart = uart_get(uart_name);
+    if (IS_ERR(uart))
+    {
+        printk(KERN_WARNING "Can't claim UART %s\n", uart_name);
+        return PTR_ERR(uart);
+    }
     result = alloc_chrdev_region(&dev, hm11_minor, 1, "hm11");
     hm11_major = MAJOR(dev);
     if (result < 0) 
 	{
         printk(KERN_WARNING "Can't get major %d\n", hm11_major);
+        uart_put(uart);
         return result;
     }
     mutex_init(&hm11_protect);
@@ -567,6 +878,7 @@ int hm11_init_module(void)
 	{
         printk(KERN_ERR "Error %d adding HM-11 cdev\n", err);
 		unregister_chrdev_region(dev, 1);
+        uart_put(uart);
     }
 	
     return err;
@@ -578,15 +890,16 @@ void hm11_cleanup_module(void)
     cdev_del(&cdev);
     unregister_chrdev_region(devno, 1);
     mutex_destroy(&hm11_protect);
+    uart_put(uart);
 
 }
 
-static ssize_t hm11_transmit(char *buf, size_t len)
+static ssize_t hm11_transmit(const char *buf, size_t len)
 {
     size_t num_bytes_sent = 0;
     while(num_bytes_sent < len)
     {
-        int ret = uart_send(&buf[num_bytes_sent],(len - num_bytes_sent));
+        int ret = uart_send(uart,&buf[num_bytes_sent],(len - num_bytes_sent));
         if(ret < 0)
         {
             printk("HM11 Write: Error in transmission %d",ret);
@@ -597,72 +910,6 @@ static ssize_t hm11_transmit(char *buf, size_t len)
     return num_bytes_sent;
 }
 
-static ssize_t fixed_wait(char *buf, size_t len)
-{
-    size_t num_bytes_received = 0;
-    int ret;
-    while(num_bytes_received < len)
-    {
-        ret = uart_receive(&buf[num_bytes_received],1);
-        printk("Character received fixed wait: %c\n", buf[num_bytes_received]);
-        if(ret < 0)
-        {
-            if(ret == -EINTR)
-            {
-                continue;
-            }
-            else
-            {
-                printk("fixed_wait: Error in reception %d",ret);
-                return ret;
-            }
-        }
-        //byte received
-        else
-        {
-            num_bytes_received += ret;
-        }
-    }
-    return num_bytes_received;  
-}
-
-static ssize_t variable_wait_limited(char *buf, size_t len, size_t timeout)
-{
-    size_t num_bytes_received = 0;
-    int ret;
-    while(num_bytes_received < len)
-    {
-        //receive one byte at a time with a gap of 1000 ms 
-        ret = uart_receive_timeout(&buf[num_bytes_received],1,timeout);
-        //return value of 0 indicates, timeout occured and no bytes were read
-        if(ret == 0)
-        {
-            goto out;
-        }
-        //error
-        else if(ret < 0)
-        {
-            if(ret == -EINTR)
-            {
-                continue;
-            }
-            else
-            {
-                printk("variable_wait_limited: Error in reception %d",ret);
-                return ret;
-            }
-        }
-        //byte received
-        else
-        {
-            num_bytes_received += ret;
-        }
-    }
-    out:
-        return num_bytes_received;
-}
-
-
 static ssize_t reallocate_memory_if(int condition,struct hm11_ioctl_str *buf,size_t packet_length)
 {
     char *tmp;
@@ -681,326 +928,439 @@ static ssize_t reallocate_memory_if(int condition,struct hm11_ioctl_str *buf,siz
     return condition;
 }
 
-static ssize_t parse_device_discovery_response(void)
+/*
+*   Appends len bytes to buf, of which used bytes are taken, growing it as needed.
+*/
+static ssize_t append_to_str(struct hm11_ioctl_str *buf, size_t *used, const char *src, size_t len)
 {
-    size_t num_bytes_written = 0;
-    ssize_t ret = 0;
-    char temp_buf[13],c;
-    //LOOK for OK+DISCS
-    ret = fixed_wait(temp_buf,8);
-    if(ret<0)
+    ssize_t ret = reallocate_memory_if(((buf->str_len - *used) < len), buf, len + HM11_STR_CHUNK);
+    if(ret < 0)
     {
         return ret;
     }
-    temp_buf[8] = 0;
-    printk("Received: %s\n", temp_buf);
-    if(strncmp(temp_buf,"OK+DISCS",8)!=0)
+    memcpy(&buf->str[*used], src, len);
+    *used += len;
+    return len;
+}
+
+static void hm11_parse_reset(struct hm11_parser *p)
+{
+    p->state = HM11_PARSE_TOKEN;
+    p->cand = 0;
+    p->matched = 0;
+    p->ev.len = 0;
+}
+
+/*
+*   Hands the token matched so far, with its argument, to fn and gets ready for the next one.
+*/
+static bool hm11_parse_emit(struct hm11_parser *p, enum hm11_event_type type, hm11_event_fn fn, void *ctx)
+{
+    bool done;
+    p->ev.type = type;
+    p->ev.arg[p->ev.len] = 0;
+    if(type == HM11_EV_RULE)
     {
-        printk("STRCMP did not go thru\n");
-        return -ENODEV;
+        p->listing = !p->listing;
     }
-    printk("OK+DISCS received.\n");
-    ret = fixed_wait(temp_buf,8);
-    if(ret<0)
+    trace_hm11_token(hm11_event_names[type], p->ev.arg);
+    done = fn(ctx, &p->ev);
+    hm11_parse_reset(p);
+    //Whatever follows the address up to the end of the line is RSSI, not needed
+    if(type == HM11_EV_DEVICE)
     {
-        return ret;
+        p->state = HM11_PARSE_SKIP_LINE;
     }
-    temp_buf[8] = 0;
-    printk("Received: %s\n", temp_buf);
-    while((strncmp(temp_buf,"OK+DISCE",8)!=0))
+    return done;
+}
+
+static void hm11_parse_append(struct hm11_parser *p, char c)
+{
+    if(p->ev.len < HM11_ARG_MAX - 1)
     {
-        if(!devices.str_len)
+        p->ev.arg[p->ev.len++] = c;
+    }
+    else
+    {
+        p->garbage++;
+    }
+}
+
+/*
+*   Advances the parser by one byte. Every byte is looked at once, except the one ending a
+*   token that a longer token could have continued, which then starts the next token.
+*   Returns true once fn has returned true.
+*/
+static bool hm11_parse_byte(struct hm11_parser *p, char c, hm11_event_fn fn, void *ctx)
+{
+    const struct hm11_token *tok;
+    unsigned int i;
+    again:
+    tok = &hm11_tokens[p->cand];
+    switch(p->state)
+    {
+    case HM11_PARSE_TOKEN:
+        if(p->listing && p->matched == 0 && c != '*')
         {
-            devices.str = kmalloc(35*sizeof(char),GFP_KERNEL);
-            if(!devices.str)
+            //Between two rules every line is a service or characteristic
+            if(c == '\r' || c == '\n')
             {
-                return -ENOMEM;
+                return p->ev.len ? hm11_parse_emit(p, HM11_EV_LINE, fn, ctx) : false;
             }
-            devices.str_len +=35;
+            hm11_parse_append(p, c);
+            return false;
         }
-        //16 bytes because ",[ADDRTYPE]:[12 byte mac addr]; ==> 1+1+1+12+1. The first ',' is optional" 
-        ret = reallocate_memory_if(((devices.str_len - num_bytes_written)<16),&devices,35);
-        if(ret < 0)
+        //The tokens sharing the bytes matched so far follow tok in the table
+        for(i = p->cand; i < ARRAY_SIZE(hm11_tokens) && strncmp(hm11_tokens[i].text, tok->text, p->matched) == 0; i++)
         {
-            goto ret_error_check;
+            if(hm11_tokens[i].text[p->matched] == c)
+            {
+                p->cand = i;
+                p->matched++;
+                return false;
+            }
         }
-        //',' is not needed if it's the first device
-        if(num_bytes_written)
-        {
-            devices.str[num_bytes_written++]=',';
-        }
-        //Copy ADDRTYPE and :
-        strncpy(&devices.str[num_bytes_written],&temp_buf[6],2);
-        num_bytes_written += 2;
-        //Read MAC address string
-        ret = fixed_wait(temp_buf,12);
-        if(ret<0)
-        {
-            goto ret_error_check;
-        }
-        temp_buf[12] = 0;
-        printk("Received: %s\n", temp_buf);
-        strncpy(&devices.str[num_bytes_written],temp_buf,12);
-        num_bytes_written += 12;
-        devices.str[num_bytes_written++]=';';
-        c = 0;
-        //Ignoring RSSI
-        while(c!='\n')
-        {
-            ret = fixed_wait(&c,1);
-            if(ret<0)
+        if(p->matched == 0)
+        {
+            //Line ends left over by the previous response are expected, anything else is garbage
+            if(c != '\r' && c != '\n')
             {
-                goto ret_error_check;
+                p->garbage++;
             }
-            printk("Received: %c\n", c);
+            return false;
         }
-        //Ideally should be OK+NAME:
-        ret = fixed_wait(temp_buf,8);
-        if(ret<0)
+        if(tok->text[p->matched] != 0)
         {
-            goto ret_error_check;
+            //Not a token after all, start over at c
+            p->garbage += p->matched;
+            hm11_parse_reset(p);
+            goto again;
         }
-        temp_buf[8] = 0;
-        printk("Received: %s\n", temp_buf);
-        //but you never know
-        if(strncmp(temp_buf,"OK+NAME:",8)!=0)
+        if(tok->arg == HM11_ARG_NONE)
         {
-            continue;
+            if(hm11_parse_emit(p, tok->type, fn, ctx))
+            {
+                p->unconsumed = true;
+                return true;
+            }
+            goto again;
         }
-        //read the entire name, until \r\n is encountered
-        while(true)
+        p->state = HM11_PARSE_ARG;
+        goto again;
+    case HM11_PARSE_ARG:
+        switch(tok->arg)
         {
-            ret = fixed_wait(&c,1);
-            if(ret<0)
+        case HM11_ARG_LINE:
+        case HM11_ARG_VALUE:
+            if(c == '\r' || c == '\n')
             {
-                goto ret_error_check;
+                return hm11_parse_emit(p, tok->type, fn, ctx);
             }
-            printk("Received: %c\n", c);
-            if(c=='\r')
+            hm11_parse_append(p, c);
+            return false;
+        case HM11_ARG_ADDR:
+            hm11_parse_append(p, c);
+            return p->ev.len == HM11_ADDR_LEN ? hm11_parse_emit(p, tok->type, fn, ctx) : false;
+        case HM11_ARG_STARS:
+            if(c == '*')
             {
-                //read \n as well
-                ret = fixed_wait(&c,1);
-                if(ret<0)
-                {
-                    goto ret_error_check;
-                    //goto outside outer while
-                }
-                printk("Received: %c\n", c);
-                break;
+                return false;
             }
-            ret = reallocate_memory_if(((devices.str_len - num_bytes_written)<1),&devices,35);
-            if(ret < 0)
+            if(hm11_parse_emit(p, tok->type, fn, ctx))
             {
-                goto ret_error_check;
+                p->unconsumed = true;
+                return true;
             }
-            devices.str[num_bytes_written++]=c;
+            goto again;
+        default:
+            break;
         }
-        ret = fixed_wait(temp_buf,8);
-        if(ret<0)
+        break;
+    case HM11_PARSE_SKIP_LINE:
+        if(c == '\n')
         {
-            goto ret_error_check;
+            hm11_parse_reset(p);
         }
-        temp_buf[8] = 0;
-        printk("Received: %s\n", temp_buf);
+        break;
     }
-    //discard the trailing \r\n
-    ret = fixed_wait(temp_buf,2);
-    temp_buf[2] = 0;
-    printk("Received: %s\n", temp_buf);
-    ret_error_check:
-    //check if any error occurred
-    if(ret<0)
+    return false;
+}
+
+/*
+*   Feeds len received bytes to the parser. Returns true once fn has returned true, used is
+*   then the number of bytes up to the end of that token. The bytes after it are not parsed.
+*/
+static bool hm11_parse(struct hm11_parser *p, const char *buf, size_t len, size_t *used, hm11_event_fn fn, void *ctx)
+{
+    size_t i;
+    for(i = 0; i < len; i++)
     {
-        kfree(devices.str);
-        devices.str_len = 0;
-        return ret;
+        p->unconsumed = false;
+        if(hm11_parse_byte(p, buf[i], fn, ctx))
+        {
+            *used = p->unconsumed ? i : i + 1;
+            return true;
+        }
     }
-    return num_bytes_written;
+    *used = len;
+    return false;
 }
 
 /*
-*   Function to read data delimited by a delimiting character of certain length (for e.g. 56 "*"s)
-*   For e.g.,
-*   The AT+FINDSERVICES? command finds services
-*   56 bytes of '*'s at the start
-*   Each service has 14 bytes of data-> 4 bytes of start handle:4 bytes of end handle:4 bytes of UUID
-*   56 bytes of of '*'s at the end
-*   The return string is formatted in such a way that the '*'s are not included in the string and each service is seperated by ','
+*   True if the bytes parsed so far are a whole token that more bytes could still extend,
+*   e.g. "OK" or "OK+CONN", a run of '*', a value or a listing line without its line end.
 */
+static bool hm11_parse_pending(const struct hm11_parser *p)
+{
+    const struct hm11_token *tok = &hm11_tokens[p->cand];
+    if(p->state == HM11_PARSE_ARG)
+    {
+        return tok->arg == HM11_ARG_STARS || tok->arg == HM11_ARG_VALUE;
+    }
+    if(p->state != HM11_PARSE_TOKEN)
+    {
+        return false;
+    }
+    if(p->matched == 0)
+    {
+        return p->listing && p->ev.len;
+    }
+    return tok->text[p->matched] == 0 && (tok->arg == HM11_ARG_NONE || tok->arg == HM11_ARG_STARS || tok->arg == HM11_ARG_VALUE);
+}
 
-static ssize_t parse_response_by_delimiter_char(size_t unit_length,struct hm11_ioctl_str *buf)
+/*
+*   The line went silent: takes a pending token as complete. Returns true once fn has returned true.
+*/
+static bool hm11_parse_flush(struct hm11_parser *p, hm11_event_fn fn, void *ctx)
 {
-    size_t num_bytes_read = 0;
-    ssize_t ret = 0;
-    char c;
-    //accounting for the ',' at the end
-    size_t packet_length = unit_length + 1;
-    //ignore the first 56 bytes
-    while(num_bytes_read < 56)
+    const struct hm11_token *tok = &hm11_tokens[p->cand];
+    if(!hm11_parse_pending(p))
     {
-        ret = fixed_wait(&c,1);
-        if(ret<0)
-        {
-            return ret;
-        }
-        num_bytes_read +=1;
+        return false;
     }
+    if(p->state == HM11_PARSE_TOKEN && p->matched == 0)
+    {
+        return hm11_parse_emit(p, HM11_EV_LINE, fn, ctx);
+    }
+    return hm11_parse_emit(p, tok->type, fn, ctx);
+}
 
-    num_bytes_read = 0;
+/*
+*   Sends cmd and feeds the response to the parser, chunk by chunk, until fn returns true
+*   or timeout ms have passed since the command was sent. The rest of the chunk holding the
+*   completing token is kept in rx_leftover.
+*   Returns 0 once fn returned true, -ETIMEDOUT, -EINTR if a signal arrived, or a reception error otherwise.
+*/
+static ssize_t hm11_command(const char *cmd, size_t len, hm11_event_fn fn, void *ctx, unsigned int timeout)
+{
+    struct hm11_parser parser = {0};
+    char chunk[HM11_CHUNK_SIZE];
+    unsigned int rx_bytes = 0;
+    ktime_t start, deadline, arrival;
+    size_t used;
+    ssize_t ret;
+    rx_leftover_len = 0;
+    ret = hm11_transmit(cmd, len);
+    if(ret < 0)
+    {
+        return ret;
+    }
+    start = ktime_get();
+    deadline = ktime_add_ms(start, timeout);
     while(true)
     {
-        //malloc the first time through
-        if(!buf->str_len)
+        s64 left = ktime_ms_delta(deadline, ktime_get());
+        bool pending = hm11_parse_pending(&parser);
+        if(left <= 0)
         {
-            buf->str = kmalloc(packet_length*sizeof(char),GFP_KERNEL);
-            if(!buf->str)
-            {
-                return -ENOMEM;
-            }
-            buf->str_len +=packet_length;
+            ret = hm11_parse_flush(&parser, fn, ctx) ? 0 : -ETIMEDOUT;
+            break;
         }
-        //read the character from receive buffer
-        ret = fixed_wait(&c,1);
-        if(ret<0)
-        {
-            goto check_ret_for_error;
-        }
-        else if(c == '*')
-            continue;
-        //if * was received, that means the end string has begun, hence break out
-        else if(c == '\r')
+        //A token that might still be extended only waits for a short silence.
+        //One burst at a time, so the bytes left behind the response keep their arrival time
+        ret = uart_receive_timestamped(uart, chunk, sizeof(chunk), &arrival, pending ? min_t(s64, left, HM11_IDLE_MS) : left);
+        if(ret < 0)
         {
-            //read the \n as well
-            ret = fixed_wait(&c,1);
-            //read the new character
-            ret = fixed_wait(&c,1);
-            if(c == '*')
+            //With a signal pending every further wait fails at once, so hand -EINTR to the
+            //caller (e.g. Ctrl-C on the server) instead of spinning until the deadline
+            if(ret != -EINTR)
             {
-                goto check_ret_for_error;
+                pr_err("hm11_command: Error in reception %zd\n", ret);
             }
-            else
+            break;
+        }
+        else if(ret == 0)
+        {
+            if(pending && hm11_parse_flush(&parser, fn, ctx))
             {
-                ret = reallocate_memory_if(((buf->str_len - num_bytes_read)<2),buf,packet_length);
-                if(ret < 0)
-                {
-                    goto check_ret_for_error;
-                }
-                //the first service/character entry does not need a ','
-                if(num_bytes_read)
-                {
-                    buf->str[num_bytes_read] = '\n';
-                    num_bytes_read += 1;
-                }
-
-                buf->str[num_bytes_read] = c;
-                num_bytes_read += 1;
+                break;
             }
         }
         else
         {
-            ret = reallocate_memory_if(((buf->str_len - num_bytes_read)<1),buf,packet_length);
-            if(ret < 0)
+            trace_hm11_rx_chunk(ret);
+            rx_bytes += ret;
+            if(hm11_parse(&parser, chunk, ret, &used, fn, ctx))
             {
-                goto check_ret_for_error;
+                rx_leftover_len = ret - used;
+                memcpy(rx_leftover, &chunk[used], rx_leftover_len);
+                rx_leftover_time = arrival;
+                ret = 0;
+                break;
             }
-            buf->str[num_bytes_read] = c;
-            num_bytes_read +=1;
         }
     }
-    ret = reallocate_memory_if(((buf->str_len - num_bytes_read)<1),buf,1);
-    if(ret >= 0)
-    {
-        buf->str[num_bytes_read] = 0;
-        num_bytes_read +=1;
-    }
-
-    check_ret_for_error:
-    if(ret<0)
+    trace_hm11_command(cmd, len, ret, ktime_to_ns(ktime_sub(ktime_get(), start)), rx_bytes, parser.garbage);
+    if(parser.garbage)
     {
-        kfree(buf->str);
-        buf->str_len = 0;
-        return ret;
+        pr_debug("hm11: %lu unexpected bytes in the response to %.*s\n", parser.garbage, (int)len, cmd);
     }
+    return ret;
+}
 
-
-
-    ret = num_bytes_read;
-    //ignore the end terminating bytes which will just be '*'s
-    while(num_bytes_read < (ret + 57))
-    {
-        fixed_wait(&c,1);
-        num_bytes_read++;
-    }
-    
-    //if memory was allocated but no characters were read
-    if(!ret)
+/*
+*   hm11_event_fn of the commands answered by a single token: looks the event up in the
+*   reply table of the command, ignoring events that are not in it.
+*/
+static bool hm11_expect(void *ctx, const struct hm11_event *ev)
+{
+    struct hm11_expect *x = ctx;
+    size_t i;
+    for(i = 0; i < x->num_replies; i++)
     {
-        kfree(buf->str);
-        //if no characters were read str_len of 0 will catch that there's no characters to be copied and return an error.
-        buf->str_len = ret;
+        const struct hm11_reply *reply = &x->replies[i];
+        if(reply->type == ev->type && (!reply->arg || (ev->len == 1 && reply->arg == ev->arg[0])))
+        {
+            x->result = reply->result;
+            return true;
+        }
     }
-    return ret;
+    return false;
 }
 
-static ssize_t hm11_echo()
+/*
+*   Sends cmd and returns the result of the first reply matching the table, -ETIMEDOUT if none arrives in time.
+*/
+static long hm11_command_expect(const char *cmd, size_t len, const struct hm11_reply *replies, size_t num_replies, unsigned int timeout)
 {
-    ssize_t ret = 0, bytes_read = 0;
-    char *receive_buf;
-    ret = hm11_transmit("AT",2);
-
-    if(ret<0)
+    struct hm11_expect x = {replies, num_replies, 0};
+    ssize_t ret = hm11_command(cmd, len, hm11_expect, &x, timeout);
+    if(ret < 0)
     {
         return ret;
     }
+    return x.result;
+}
 
-    receive_buf = kmalloc(7*sizeof(char),GFP_KERNEL);
-    if(!receive_buf)
+/*
+*   Builds the device list as "[ADDRTYPE]:[MAC];[NAME]" entries separated by ','. The name is optional.
+*/
+static bool collect_devices(void *ctx, const struct hm11_event *ev)
+{
+    struct hm11_collect *col = ctx;
+    switch(ev->type)
     {
-        return -ENOMEM;
+    case HM11_EV_DISCS:
+        col->started = true;
+        break;
+    case HM11_EV_DEVICE:
+        //',' is not needed if it's the first device
+        if(col->used)
+        {
+            col->ret = append_to_str(col->buf, &col->used, ",", 1);
+        }
+        if(col->ret >= 0)
+        {
+            col->ret = append_to_str(col->buf, &col->used, ev->arg, ev->len);
+        }
+        if(col->ret >= 0)
+        {
+            col->ret = append_to_str(col->buf, &col->used, ";", 1);
+        }
+        return col->ret < 0;
+    case HM11_EV_NAME:
+        //A name that does not follow an address has nowhere to go
+        if(col->used)
+        {
+            col->ret = append_to_str(col->buf, &col->used, ev->arg, ev->len);
+        }
+        return col->ret < 0;
+    case HM11_EV_DISCE:
+        return col->started;
+    default:
+        break;
     }
-    //unconditional wait for two bytes (since we expect a minimum of two bytes) and optional wait for more (upto 7)
-    while(bytes_read <2)
+    return false;
+}
+
+/*
+*   Builds the service or characteristic list, one entry per line, from the lines between
+*   the two rules of '*' the HM-11 frames it with.
+*/
+static bool collect_lines(void *ctx, const struct hm11_event *ev)
+{
+    struct hm11_collect *col = ctx;
+    switch(ev->type)
     {
-        ret = variable_wait_limited(&receive_buf[bytes_read],(7 - bytes_read), 1000);
-        //return error
-        if(ret < 0)
+    case HM11_EV_RULE:
+        //The first rule opens the list, the second one closes it
+        if(col->started)
         {
-            goto free_mem;
+            return true;
         }
-        bytes_read += ret;
-        //if minimum two bytes read
-        if(bytes_read >= 2)
+        col->started = true;
+        break;
+    case HM11_EV_LINE:
+        //the first service/characteristic entry does not need a '\n'
+        if(col->used)
         {
-            if(bytes_read == 9)
-            {
-                if(strncmp(receive_buf,"OK+WAKE",7)==0)
-                {
-                    ret = 2;
-                    goto free_mem;
-                }
-                else if(strncmp(receive_buf,"OK+LOST",7)==0)
-                {
-                    ret = 1;
-                    goto free_mem;
-                }
-                //HANDLE GARBAGE CASE: 7 bytes read but they didn't correspond to expected values
-            }
-            else if(bytes_read == 2)
-            {
-                if(strncmp(receive_buf,"OK",bytes_read)==0)
-                {
-                    ret = 0;
-                    goto free_mem;
-                }
-                //HANDLE GARBAGE CASE: two bytes were read but it was not OK
-            }
-            //HANDLE GARBAGE CASE: Some number of bytes other than 7 and two bytes were read
+            col->ret = append_to_str(col->buf, &col->used, "\n", 1);
         }
+        if(col->ret >= 0)
+        {
+            col->ret = append_to_str(col->buf, &col->used, ev->arg, ev->len);
+        }
+        return col->ret < 0;
+    default:
+        break;
     }
-    //uart_receive()
-    free_mem:
-        kfree(receive_buf);
-        return ret;
+    return false;
+}
+
+/*
+*   Sends cmd and collects the service or characteristic list into buf, NUL-terminated.
+*   Returns its length including the NUL, 0 if the list is empty.
+*/
+static ssize_t hm11_list(const char *cmd, size_t len, struct hm11_ioctl_str *buf)
+{
+    struct hm11_collect col = {buf, 0, false, 0};
+    ssize_t ret = hm11_command(cmd, len, collect_lines, &col, HM11_LIST_TIMEOUT_MS);
+    if(ret >= 0)
+    {
+        ret = col.ret;
+    }
+    if(ret >= 0 && col.used)
+    {
+        ret = append_to_str(buf, &col.used, "", 1);
+    }
+    if(ret < 0 || !col.used)
+    {
+        kfree(buf->str);
+        buf->str = NULL;
+        buf->str_len = 0;
+        return ret < 0 ? ret : 0;
+    }
+    return col.used;
+}
+
+static ssize_t hm11_echo()
+{
+    static const struct hm11_reply replies[] = {
+        {HM11_EV_OK, 0, 0},
+        {HM11_EV_LOST, 0, 1},
+        {HM11_EV_WAKE, 0, 2},
+    };
+    return hm11_command_expect("AT", 2, replies, ARRAY_SIZE(replies), HM11_COMMAND_TIMEOUT_MS);
 }
 
 static void hm11_mac_read(char *str)
@@ -1030,92 +1390,36 @@ static long hm11_connect_last()
 
 static long hm11_mac_connect(char *str)
 {
-    ssize_t ret = 0,bytes_read=0;
-
+    //OK+CONNA only acknowledges the command, the outcome follows once the link is up or has failed
+    static const struct hm11_reply replies[] = {
+        {HM11_EV_CONN, 0, 0},
+        {HM11_EV_CONNE, 0, -ENODEV},
+        {HM11_EV_CONNF, 0, -ENODEV},
+    };
     char mac_cmd[20];
-    char *receive_buf;
     snprintf(mac_cmd, sizeof(mac_cmd), "AT+CON%s", str);
-    
-    ret = hm11_transmit(mac_cmd,18);
-    if(ret<0)
-    {
-        return ret;
-    }
-    receive_buf = kmalloc(8*sizeof(char),GFP_KERNEL);
-    if(!receive_buf)
-    {
-        return -ENOMEM;
-    }
-    ret = fixed_wait(receive_buf,8);
-    if(ret < 0)
-    {
-        goto free_mem;
-    }
-    while(bytes_read <9)
-    {
-        ret = variable_wait_limited(&receive_buf[bytes_read],(10 - bytes_read), 1000);
-        //return error
-        if(ret < 0)
-        {
-            goto free_mem;
-        }
-        bytes_read += ret;
-        //if minimum seven bytes read
-        if(bytes_read >= 9)
-        {
-            if(bytes_read == 10)
-            {
-                if(strncmp(receive_buf,"OK+CONNA",8)==0)
-                {
-                    ret = 0;
-                    goto free_mem;
-                }
-                else if(strncmp(receive_buf,"OK+CONNE",8)==0)
-                {
-                    ret = -ENODEV;
-                    goto free_mem;
-                }
-                else if(strncmp(receive_buf,"OK+CONNF",8)==0)
-                {
-                    ret = -ENODEV;
-                    goto free_mem;
-                }
-                //HANDLE GARBAGE CASE: 8 bytes read but they didn't correspond to expected values
-            }
-            else if(bytes_read == 9)
-            {
-                if(strncmp(receive_buf,"OK+CONN",7)==0)
-                {
-                    ret = 0;
-                    goto free_mem;
-                }
-                //HANDLE GARBAGE CASE: 7 bytes were read but it was not OK+CONN
-            }
-            //HANDLE GARBAGE CASE: Some number of bytes other than 7 and 8 bytes were read
-        }
-    }
-    free_mem:
-        kfree(receive_buf);
-    return ret;
+    return hm11_command_expect(mac_cmd, 18, replies, ARRAY_SIZE(replies), HM11_CONNECT_TIMEOUT_MS);
 }
 
 static ssize_t hm11_device_probe(void)
 {
-    ssize_t ret = 0;
-    ret = hm11_transmit("AT+DISC?",8);
-    if(ret<0)
+    struct hm11_collect col = {&devices, 0, false, 0};
+    ssize_t ret = hm11_command("AT+DISC?", 8, collect_devices, &col, HM11_DISCOVERY_TIMEOUT_MS);
+    if(ret >= 0)
     {
-        return ret;
+        ret = col.ret;
     }
-    ret = parse_device_discovery_response();
-    if(ret<0)
+    if(ret < 0)
     {
+        kfree(devices.str);
+        devices.str = NULL;
+        devices.str_len = 0;
         devices_str_num_chars_to_copy = 0;
         return ret;
     }
-    devices_str_num_chars_to_copy = ret;
+    devices_str_num_chars_to_copy = col.used;
     //convention to require one more byte than actually needed.
-    return (ret + 1);
+    return (col.used + 1);
 }
 
 static ssize_t hm11_services_probe(void)
@@ -1125,18 +1429,12 @@ static ssize_t hm11_services_probe(void)
     {
         return (service_str_num_chars_to_copy + 1);
     }
-    ret = hm11_transmit("AT+FINDSERVICES?",16);
-    if(ret<0)
-    {
-        return ret;
-    }
-    //unit length:
+    //Each service:
     //P1: 4 Bytes, Services start handle.
     //P2: 4 Bytes, Services end handle
     //P3: Services UUID (upto 16 bytes)
     //P1:P2:P3
-    //4+1+4+1+16 = 26 
-    ret = parse_response_by_delimiter_char(26,&services);
+    ret = hm11_list("AT+FINDSERVICES?", 16, &services);
     if(ret<0)
     {
         service_str_num_chars_to_copy = 0;
@@ -1154,18 +1452,12 @@ static ssize_t hm11_characteristics_probe(void)
     {
         return (characteristics_str_num_chars_to_copy + 1);
     }
-    ret = hm11_transmit("AT+FINDALLCHARS?",16);
-    if(ret<0)
-    {
-        return ret;
-    }
-    //unit length:
+    //Each characteristic:
     //P1 - 4 Bytes, Characteristic handle.
     //P2 - 14 Bytes, “RD|WR|WN|NO|IN” 
     //P3 - Characteristic UUID (assumed to be 16 bytes since it can be max that)
     //P1:P2:P3
-    //4+1+14+1+16 = 36 
-    ret = parse_response_by_delimiter_char(36,&characteristics);
+    ret = hm11_list("AT+FINDALLCHARS?", 16, &characteristics);
     if(ret<0)
     {
         characteristics_str_num_chars_to_copy = 0;
@@ -1178,131 +1470,39 @@ static ssize_t hm11_characteristics_probe(void)
 
 static long hm11_characteristic_notify(char *str)
 {
-    ssize_t ret = 0;
     char characteristic_notify_cmd[20];
-    char *buf;
     snprintf(characteristic_notify_cmd, sizeof(characteristic_notify_cmd), "AT+NOTIFY_ON%s", str);
-    ret = hm11_transmit(characteristic_notify_cmd,16);
-    if(ret<0)
-    {
-        return ret;
-    }
-    buf = kmalloc(10*sizeof(char),GFP_KERNEL);
-    if(!buf)
-    {
-        return -ENOMEM;
-    }
-    ret = fixed_wait(buf,12);
-    if(ret>0)
-    {
-        if(strncmp(buf,"OK+SEND-OK",10)==0)
-        {
-            ret = 0;
-        }
-        else if(strncmp(buf,"OK+DATA-OK",10)==0)
-        {
-            ret = 0;
-        }
-        else if(strncmp(buf,"OK+SEND-ER",10)==0)
-        {
-            ret = -ENODEV;
-            //RETURN ERROR
-        }
-        else if(strncmp(buf,"OK+DATA-ER",10)==0)
-        {
-            ret = -ENODEV;
-        }
-        //Handle error
-    }
-    kfree(buf);
-    return ret;
+    return hm11_command_expect(characteristic_notify_cmd, 16, notify_replies, ARRAY_SIZE(notify_replies), HM11_COMMAND_TIMEOUT_MS);
 }
 
 static long hm11_characteristic_notify_off(char *str)
 {
     long ret = 0;
     char characteristic_notify_off_cmd[20];
-    char *buf;
-    char *res_start;
     snprintf(characteristic_notify_off_cmd, sizeof(characteristic_notify_off_cmd), "AT+NOTIFYOFF%s", str);
 
-    //Flush contents on the UART buffer
-    uart_flush_buffer();
-
-    ret = hm11_transmit(characteristic_notify_off_cmd,16);
-    
-    if(ret<0)
-    {
-        return ret;
-    }
+    //The response has to be read with uart_receive*() again
+    hm11_ingest_stop();
 
-    buf = kmalloc(512*sizeof(char),GFP_KERNEL);
-    if(!buf)
-    {
-        return -ENOMEM;
-    }
+    //Flush contents on the UART buffer
+    uart_flush_buffer(uart);
 
-    ret = variable_wait_limited(buf,512,1000);
-    //Find the last "O from OK+..."
-    res_start = &buf[ret - 1 - 11];
-    res_start[12] = 0;
-
-    if(ret>0)
-    {
-        if(strncmp(res_start,"OK+SEND-OK\r\n",10)==0)
-        {
-            ret = 0;
-        }
-        else if(strncmp(res_start,"OK+DATA-OK",10)==0)
-        {
-            ret = 0;
-        }
-        else if(strncmp(res_start,"OK+SEND-ER",10)==0)
-        {
-            ret = -ENODEV;
-        }
-        else if(strncmp(res_start,"OK+DATA-ER",10)==0)
-        {
-            ret = -ENODEV;
-        }
-        //Handle error
-    }
-    kfree(buf);
+    //Notifications still arriving until the HM-11 processes the command are skipped by the parser
+    ret = hm11_command_expect(characteristic_notify_off_cmd, 16, notify_replies, ARRAY_SIZE(notify_replies), HM11_COMMAND_TIMEOUT_MS);
 
     //Flush contents on the UART buffer
-    uart_flush_buffer();
+    uart_flush_buffer(uart);
 
     return ret;
 }
 
 static ssize_t hm11_passive()
 {
-    ssize_t ret = 0;
-    char *buf;
-    ret = hm11_transmit("AT+IMME1",8);
-    if(ret<0)
-    {
-        return ret;
-    }
-    buf = kmalloc(8*sizeof(char),GFP_KERNEL);
-    if(!buf)
-    {
-        return -ENOMEM;
-    }
-    ret = fixed_wait(buf,8);
-    if(ret>0)
-    {
-        if(strncmp(buf,"OK+Set:1",8)==0)
-        {
-            ret = 0;
-        }
-        else
-        {
-            //RETURN ERROR
-        }
-    }
-    kfree(buf);
-    return ret;
+    static const struct hm11_reply replies[] = {
+        {HM11_EV_SET, '1', 0},
+        {HM11_EV_SET, 0, -EIO},
+    };
+    return hm11_command_expect("AT+IMME1", 8, replies, ARRAY_SIZE(replies), HM11_COMMAND_TIMEOUT_MS);
 }
 
 static void hm11_set_name(char *str)
@@ -1315,32 +1515,10 @@ static void hm11_set_name(char *str)
 
 static ssize_t hm11_reset()
 {
-    ssize_t ret = 0;
-    char *buf;
-    ret = hm11_transmit("AT+RESET",8);
-    if(ret<0)
-    {
-        return ret;
-    }
-    buf = kmalloc(8*sizeof(char),GFP_KERNEL);
-    if(!buf)
-    {
-        return -ENOMEM;
-    }
-    ret = fixed_wait(buf,8);
-    if(ret>0)
-    {
-        if(strncmp(buf,"OK+RESET",8)==0)
-        {
-            ret = 0;
-        }
-        else
-        {
-            //RETURN ERROR
-        }
-    }
-    kfree(buf);
-    return ret;
+    static const struct hm11_reply replies[] = {
+        {HM11_EV_RESET, 0, 0},
+    };
+    return hm11_command_expect("AT+RESET", 8, replies, ARRAY_SIZE(replies), HM11_COMMAND_TIMEOUT_MS);
     /*write_uart("AT+RENEW");
       read_uart();
     */
@@ -1348,57 +1526,14 @@ static ssize_t hm11_reset()
 
 static ssize_t hm11_set_role(char *str)
 {
-    ssize_t ret = 0;
+    //OK+Set: echoes the role that was set
+    const struct hm11_reply replies[] = {
+        {HM11_EV_SET, str[0], 0},
+        {HM11_EV_SET, 0, -EIO},
+    };
     char role_cmd[9];
-    char *buf;
     snprintf(role_cmd, sizeof(role_cmd), "AT+ROLE%s", str);
-    ret = hm11_transmit(role_cmd,8);
-    if(ret<0)
-    {
-        return ret;
-    }
-    buf = kmalloc(8*sizeof(char),GFP_KERNEL);
-    if(!buf)
-    {
-        return -ENOMEM;
-    }
-    ret = fixed_wait(buf,8);
-    if(ret>0)
-    {
-        char expected_str[9];
-        snprintf(expected_str,sizeof(expected_str), "OK+Set:%s", str);
-        if(str[0] == '1')
-        {
-            if(strncmp(buf, "OK+Set:1", 8) == 0)
-            {
-                ret = 0;
-            }
-            else
-            {
-                //RETURN ERROR
-            }
-        }
-        else if(str[0] == '0')
-        {
-            if(strncmp(buf, "OK+Set:0", 8) == 0)
-            {
-                ret = 0;
-            }
-            else
-            {
-                //RETURN ERROR
-            }
-        }
-        else
-        {
-            //RETURN ERROR
-        }
-
-    }
-    kfree(buf);
-    return ret;
-    /*write_uart("role_cmd");
-    read_uart();*/
+    return hm11_command_expect(role_cmd, 8, replies, ARRAY_SIZE(replies), HM11_COMMAND_TIMEOUT_MS);
 }
 
 static void hm11_sleep()
@@ -1415,8 +1550,25 @@ static ssize_t hm11_read_notified(void)
 
     char buffer_contents[512];
 
+    if(ingesting)
+    {
+        ssize_t ret = 0;
+        spin_lock(&samples_lock);
+        if(samples_head != samples_tail)
+        {
+            struct hm11_sample *newest = &samples[(samples_head - 1) & (SAMPLE_RING_SIZE - 1)];
+            if(newest->seq != samples_notified_seq)
+            {
+                samples_notified_seq = newest->seq;
+                ret = newest->value;
+            }
+        }
+        spin_unlock(&samples_lock);
+        return ret;
+    }
+
     //Read all buffer contents
-    bytes_received = variable_wait_limited(buffer_contents,512,1);
+    bytes_received = uart_receive_deadline(uart,buffer_contents,512,ktime_add_ms(ktime_get(),1));
 
     //return error
     if(bytes_received < 0)
@@ -1447,5 +1599,86 @@ static ssize_t hm11_read_notified(void)
         return buffer_contents[index + 1];
 }
 
+/*
+*   Starts collecting notifications in the background. Every HEART_RATE_ID byte followed by
+*   a value becomes a sample in the ring, until hm11_ingest_stop() is called.
+*/
+static int hm11_ingest_start(void)
+{
+    int ret;
+    if(ingesting)
+    {
+        return 0;
+    }
+    heart_rate_id_seen = false;
+    //Notifications that arrived along with the confirmation were already taken from the UART
+    if(rx_leftover_len)
+    {
+        hm11_ingest(NULL, rx_leftover, rx_leftover_len, rx_leftover_time);
+        rx_leftover_len = 0;
+    }
+    ret = uart_register_rx_handler(uart, hm11_ingest, NULL);
+    if(ret < 0)
+    {
+        printk("hm11: Can't start notification ingestion %d\n", ret);
+        return ret;
+    }
+    WRITE_ONCE(ingesting, true);
+    return 0;
+}
+
+/*
+*   Stops collecting notifications, the UART can be read with uart_receive*() again.
+*   Samples already in the ring are kept.
+*/
+static void hm11_ingest_stop(void)
+{
+    if(!ingesting)
+    {
+        return;
+    }
+    uart_unregister_rx_handler(uart);
+    WRITE_ONCE(ingesting, false);
+    //Blocked readers get what is left, then end of file
+    wake_up_interruptible(&samples_waitQ);
+}
+
+/*
+*   RX handler of the UART while subscribed, called with every chunk of received bytes.
+*   The state carries over between chunks, so a notification split across two of them is not lost.
+*/
+static void hm11_ingest(void *priv, const char *buf, size_t len, ktime_t arrival)
+{
+    //The handler runs from a work item, possibly well after the bytes arrived. The UART
+    //driver records when the interrupt drained them, every call is a single burst
+    s64 now = ktime_to_ns(arrival ? arrival : ktime_get());
+    size_t i;
+    spin_lock(&samples_lock);
+    for(i = 0; i < len; i++)
+    {
+        struct hm11_sample *sample;
+        if(!heart_rate_id_seen)
+        {
+            heart_rate_id_seen = (buf[i] == HEART_RATE_ID);
+            continue;
+        }
+        heart_rate_id_seen = false;
+        if(samples_head - samples_tail == SAMPLE_RING_SIZE)
+        {
+            samples_tail++;
+            samples_overwritten++;
+        }
+        sample = &samples[samples_head & (SAMPLE_RING_SIZE - 1)];
+        sample->time_ns = now;
+        sample->seq = ++samples_seq;
+        sample->value = buf[i];
+        samples_head++;
+        trace_hm11_sample(sample->value, sample->seq);
+    }
+    spin_unlock(&samples_lock);
+    //Once per chunk, however many samples it carried
+    wake_up_interruptible(&samples_waitQ);
+}
+
 module_init(hm11_init_module);
 module_exit(hm11_cleanup_module);
\ No newline at end of file
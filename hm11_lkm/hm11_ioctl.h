@@ -36,10 +36,27 @@ struct hm11_ioctl_str
     size_t str_len;
 };
 
+//Heart rate notification, as kept in the sample ring of the driver
+    //read() on /dev/hm11 returns whole records, oldest first, and blocks until one is available
+    //(-EAGAIN with O_NONBLOCK). poll() reports POLLIN while samples are waiting. Once the
+    //notification is unsubscribed and the ring is empty, read() returns 0 and poll() POLLHUP
+struct hm11_sample
+{
+    //CLOCK_MONOTONIC time in ns at which the UART interrupt received the notification
+    int64_t time_ns;
+    //Counts every sample since the module was loaded, a gap means samples were overwritten
+    uint32_t seq;
+    //Heart rate in beats per minute
+    uint8_t value;
+    uint8_t reserved[3];
+};
+
 
 //Picked an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define HM11_IOC_MAGIC 0x18
 
+//Every command that waits for a response returns -ETIMEDOUT if the HM-11 does not send it in time
+
 //Echo command.
     //If char == 0, the device is awake and not paired
     //If char == 1, the device was paired and has been disconnected (this cmd does not force a disconnection)
@@ -109,6 +126,8 @@ struct hm11_ioctl_str
 #define HM11_SLEEP  _IO(HM11_IOC_MAGIC, 18)
 
 //Read most recent notified value
+    //While subscribed with HM11_CHARACTERISTIC_NOTIFY, notifications are collected in the background
+    //and this returns the newest sample not returned before, -EAGAIN if there is none
 #define HM11_READ_NOTIFIED _IOR(HM11_IOC_MAGIC, 19, char)
 
 /**
@@ -0,0 +1,96 @@
+/**
+* @file hm11_trace.h
+* @brief Declares the tracepoints of the HM-11 driver
+*
+* Kernel-space only. The events show up under /sys/kernel/tracing/events/hm11
+* and cost a single patched-out branch each while disabled.
+*
+* @version 1.0
+*
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hm11
+
+#if !defined(HM11_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define HM11_TRACE_H
+
+#include <linux/tracepoint.h>
+
+//Bytes taken from the UART in one call while waiting for a response
+TRACE_EVENT(hm11_rx_chunk,
+    TP_PROTO(unsigned int len),
+    TP_ARGS(len),
+    TP_STRUCT__entry(
+        __field(unsigned int, len)
+    ),
+    TP_fast_assign(
+        __entry->len = len;
+    ),
+    TP_printk("len=%u", __entry->len)
+);
+
+//Response token recognised by the parser, with its argument (empty if it has none)
+TRACE_EVENT(hm11_token,
+    TP_PROTO(const char *token, const char *arg),
+    TP_ARGS(token, arg),
+    TP_STRUCT__entry(
+        __string(token, token)
+        __string(arg, arg)
+    ),
+    TP_fast_assign(
+        __assign_str(token, token);
+        __assign_str(arg, arg);
+    ),
+    TP_printk("%s arg=\"%s\"", __get_str(token), __get_str(arg))
+);
+
+//One command and its response: result, time from sending it to the end of the response,
+//bytes received meanwhile and how many of them were skipped as garbage
+TRACE_EVENT(hm11_command,
+    TP_PROTO(const char *cmd, unsigned int cmd_len, long result, s64 duration_ns, unsigned int rx_bytes, unsigned long garbage),
+    TP_ARGS(cmd, cmd_len, result, duration_ns, rx_bytes, garbage),
+    TP_STRUCT__entry(
+        __dynamic_array(char, cmd, cmd_len + 1)
+        __field(long, result)
+        __field(s64, duration_ns)
+        __field(unsigned int, rx_bytes)
+        __field(unsigned long, garbage)
+    ),
+    TP_fast_assign(
+        //The command is not NUL-terminated at cmd_len
+        memcpy(__get_dynamic_array(cmd), cmd, cmd_len);
+        ((char *)__get_dynamic_array(cmd))[cmd_len] = 0;
+        __entry->result = result;
+        __entry->duration_ns = duration_ns;
+        __entry->rx_bytes = rx_bytes;
+        __entry->garbage = garbage;
+    ),
+    TP_printk("%s result=%ld duration_ns=%lld rx_bytes=%u garbage=%lu", __get_str(cmd), __entry->result,
+        __entry->duration_ns, __entry->rx_bytes, __entry->garbage)
+);
+
+//Heart rate notification added to the sample ring
+TRACE_EVENT(hm11_sample,
+    TP_PROTO(u8 value, u32 seq),
+    TP_ARGS(value, seq),
+    TP_STRUCT__entry(
+        __field(u8, value)
+        __field(u32, seq)
+    ),
+    TP_fast_assign(
+        __entry->value = value;
+        __entry->seq = seq;
+    ),
+    TP_printk("value=%u seq=%u", __entry->value, __entry->seq)
+);
+
+#endif /* HM11_TRACE_H */
+
+//Must be outside the include guard. The header is not in include/trace/events,
+//so the Makefile adds this directory to the include path
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hm11_trace
+#include <trace/define_trace.h>
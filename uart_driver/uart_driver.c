@@ -36,17 +36,148 @@
 #include <linux/slab.h>
 #include <linux/jiffies.h>
 #include <linux/mutex.h>
+#include <linux/delay.h>
+#include <asm/barrier.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/jump_label.h>
+#include <linux/hrtimer.h>
+#include <linux/serial_core.h>
+#include <linux/tty.h>
+#include <linux/tty_flip.h>
+#include <linux/kref.h>
+#include "uart_ioctl.h"
+#include "uart_driver.h"
 
+#define CREATE_TRACE_POINTS
+#include "uart_trace.h"
 
-#define BUFF_SIZE 512
 
-//Circular buffer struct
+//Buffer sizes must be powers of two so indices can be masked instead of using %
+#define DEFAULT_RX_BUFF_SIZE 512
+#define MIN_RX_BUFF_SIZE 64
+#define TX_BUFF_SIZE 512
+
+//Size of the per-device bounce buffer user writes are copied through
+#define TX_CHUNK_SIZE 256
+
+//Depth of the AM335x UART TX FIFO, filled in one go on every THR empty interrupt
+#define TX_FIFO_SIZE 64
+
+//Depth of the AM335x UART RX FIFO
+#define RX_FIFO_SIZE 64
+
+//Characters the RX FIFO may collect between two polls in polling mode. Half its
+//depth, so a timer running late still drains it before it overruns
+#define RX_POLL_CHARS (RX_FIFO_SIZE / 2)
+
+//SCR TX_EMPTY_CTL_IT: the THR interrupt fires once the TX FIFO is empty instead of at
+//the TX trigger level, so every THR interrupt leaves the whole FIFO to be filled
+#define UART_OMAP_SCR_TX_EMPTY 0x08
+
+//Size of the per-device tap buffer, a power of two
+#define TAP_BUFF_SIZE 8192
+
+//Number of buckets of the RX buffer occupancy histogram in debugfs
+#define RX_OCCUPANCY_BUCKETS 8
+
+//RX FIFO trigger levels supported by the AM335x UART and their FCR encoding
+struct rx_trigger_level
+{
+    unsigned int level;
+    unsigned int fcr_bits;
+};
+
+static const struct rx_trigger_level rx_trigger_levels[] =
+{
+    {8, UART_FCR_R_TRIG_00},
+    {16, UART_FCR_R_TRIG_01},
+    {56, UART_FCR_R_TRIG_10},
+    {60, UART_FCR_R_TRIG_11},
+};
+
+//Default RX FIFO trigger level of every uart_serial device
+static unsigned int rx_trigger = 8;
+module_param(rx_trigger, uint, S_IRUGO);
+MODULE_PARM_DESC(rx_trigger, "RX FIFO trigger level in characters (8, 16, 56 or 60)");
+
+//Adaptive RX polling defaults, tunable per device in debugfs. The threshold is well above
+//the default trigger level: a trigger level interrupt alone drains about rx_trigger bytes,
+//only an interrupt that can not keep up with the line finds this many in the FIFO
+static unsigned int poll_threshold = 32;
+module_param(poll_threshold, uint, S_IRUGO);
+MODULE_PARM_DESC(poll_threshold, "Bytes drained by one RX interrupt that switch to polling mode (keep it above rx_trigger), 0 to never poll");
+static unsigned int poll_interval_us = 1000;
+module_param(poll_interval_us, uint, S_IRUGO);
+MODULE_PARM_DESC(poll_interval_us, "Longest RX FIFO polling period in polling mode, in microseconds. Shorter at high baud rates, so the FIFO never fills between polls");
+static unsigned int poll_idle_limit = 2;
+module_param(poll_idle_limit, uint, S_IRUGO);
+MODULE_PARM_DESC(poll_idle_limit, "Consecutive empty polls that switch back to interrupt mode");
+
+//RX buffer size of uart1, uart4 and uart5, indexed by enum uart_number
+static unsigned int rx_buffer_size[] = {DEFAULT_RX_BUFF_SIZE, DEFAULT_RX_BUFF_SIZE, DEFAULT_RX_BUFF_SIZE};
+module_param_array(rx_buffer_size, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(rx_buffer_size, "RX buffer size in bytes of uart1,uart4,uart5 (rounded up to a power of two)");
+
+//uart1, uart4 and uart5 registered with serial_core instead of as uart_serial misc devices
+static bool tty[] = {false, false, false};
+module_param_array(tty, bool, NULL, S_IRUGO);
+MODULE_PARM_DESC(tty, "Register uart1,uart4,uart5 as /dev/ttyUS0-2 instead of uart_serial devices");
+
+//Single-producer/single-consumer circular buffer.
+//For RX, head is only advanced by the IRQ handler (in rx_head, see uart_serial_dev), tail
+//only by the (serialized) consumer.
+//For TX the roles are swapped: writers (serialized) advance head, the IRQ handler advances tail.
+//Both are free running and masked with size - 1 on access, so head - tail is the length.
+//The RX indices live in the first page of the area user space can mmap(), so the tail
+//may be written by user space and is never trusted to be within size of the head.
 struct circ_buff
 {
-    char buff[BUFF_SIZE];
-    int read_pos;
-    int write_pos;
-    int length;
+    char *buff;
+    unsigned int size;
+    struct uart_ring_header *hdr;
+};
+
+//Arrival time of the bytes drained from the RX FIFO by one interrupt.
+//The burst runs from start up to the start of the next one (or the head).
+struct rx_burst
+{
+    unsigned int start;
+    ktime_t time;
+};
+
+//Counters only exposed through debugfs. The RX error ones are only updated under rx_lock,
+//the other RX and TX ones by the IRQ handler or rx_poll_timer (never both at once),
+//tx_stalls and tx_stall_ns only by the (serialized) writer
+struct uart_debug_stats
+{
+    u32 rx_framing_errors;
+    u32 rx_parity_errors;
+    u32 rx_breaks;
+    u32 tx_bytes;
+    //Wakeups of readers and writers issued by the IRQ handler
+    u32 rx_wakeups;
+    u32 tx_wakeups;
+    //Number of times, and total time, a writer slept waiting for room in the TX buffer
+    u32 tx_stalls;
+    u64 tx_stall_ns;
+    //Adaptive RX mode: switches to polling, and time spent in each mode up to the last switch
+    u32 rx_poll_entries;
+    u64 rx_irq_mode_ns;
+    u64 rx_poll_mode_ns;
+    //RX buffer occupancy after every drained burst, in eighths of the buffer size
+    u32 rx_occupancy[RX_OCCUPANCY_BUCKETS];
+    //RX bursts merged into the previous one because the burst ring was full,
+    //their bytes are reported with that burst's (older) arrival time
+    u32 rx_burst_merges;
 };
 
 enum uart_number
@@ -54,20 +185,119 @@ enum uart_number
     UART1,
     UART4,
     UART5,
+    UART_UNKNOWN,
 };
 
 //Serial device struct
 struct uart_serial_dev
 {
+    //Register backend, memory mapped registers (regs) unless a model is given as platform data
+    const struct uart_reg_ops *ops;
+    void *reg_ctx;
     void __iomem *regs;
     struct miscdevice mDev;
     int irq;
     struct circ_buff buf;
+    //Producer index of buf. hdr->head is only a copy of it published to a mapping of the
+    //ring: user space can write the whole header page, so the driver never reads it back
+    unsigned int rx_head;
     wait_queue_head_t waitQ;
-    unsigned long irqFlags;
+    //Start of the vmalloc'ed area holding the RX header page and ring, for mmap()
+    void *rx_area;
+    //Number of user space mappings of rx_area, protected by uart_devices_lock. It only leaves
+    //zero in mmap(), under read_protect too. It drops back to zero in uart_vma_close(), which
+    //runs under mmap_lock and can not take read_protect, so the tail is made sane before the
+    //release there and readers load it with acquire
+    unsigned int rx_mapped;
+    struct circ_buff tx_buf;
+    struct uart_ring_header tx_hdr;
+    wait_queue_head_t tx_waitQ;
+    //Bounce buffer for write(), protected by write_protect
+    char *tx_chunk;
+    //Set to disable the \n to \n\r translation
+    bool tx_raw;
+    //Shadow of the IER register, protected by lock
+    unsigned int ier;
+    //Line configuration, reprogrammed as a whole by program_line()
+    unsigned int uartclk;
+    struct uart_line_config line;
+    unsigned int divisor;
+    //UART_OMAP_MDR1_16X_MODE or UART_OMAP_MDR1_13X_MODE, whichever divides closer to the baud rate
+    unsigned int mdr1;
+    unsigned int lcr;
+    unsigned int fcr;
+    unsigned int rx_trigger;
+    //Only updated by the IRQ handler and rx_poll_timer, the RX error counts under rx_lock
+    struct uart_irq_stats stats;
+    struct uart_debug_stats dbg;
+    //Per device debugfs directory, NULL if debugfs is not available
+    struct dentry *debugfs;
     enum uart_number this_uart_number;
+    //Set if the UART is a serial_core port. None of the uart_serial buffers, devices or
+    //the exported API exist then, everything goes through the tty layer
+    bool tty;
+    struct uart_port port;
+    //Short name used by uart_get(), e.g. "uart1"
+    const char *name;
+    struct device *parent;
+    //Entry in uart_devices
+    struct list_head node;
+    //Set while an LKM holds the handle, protected by uart_devices_lock
+    bool claimed;
+    //Only taken around register sequences that must not interleave: the IER
+    //read-modify-write and the DLAB window, where IER's offset maps to DLM
     spinlock_t lock;
+    //Serializes every LSR read and RX FIFO drain of the IRQ handler, rx_poll_timer and
+    //tx_flush(). Reading LSR clears its error flags, so a racing reader would lose them
+    spinlock_t rx_lock;
     struct mutex write_protect;
+    struct mutex read_protect;
+    //Set by the (single) reader before sleeping, so the IRQ only wakes it when it can make progress
+    unsigned int rx_watermark;
+    int rx_delim;
+    //Ring of RX burst arrival times, same scheme as buf: the IRQ handler advances
+    //burst_head, the consumer advances burst_tail as the bytes are read. bursts_size is
+    //a power of two, sized at probe for a full RX buffer of trigger level bursts
+    struct rx_burst *bursts;
+    unsigned int bursts_size;
+    unsigned int burst_head;
+    unsigned int burst_tail;
+    //Push-model consumer, set with uart_register_rx_handler(). Protected by read_protect,
+    //the IRQ handler only reads rx_handler to decide whether to queue rx_work
+    uart_rx_handler_t rx_handler;
+    void *rx_handler_priv;
+    struct work_struct rx_work;
+    //Tap device mirroring the traffic, see tap_record_ring(). tap_buf only exists while
+    //the tap is open. RX is recorded by the IRQ handler or rx_poll_timer and TX by the IRQ
+    //handler, possibly at once on SMP, so tap_active and tap_head are protected by tap_lock.
+    //The (single) tap reader advances tap_tail
+    struct miscdevice tapDev;
+    unsigned long tap_busy;
+    spinlock_t tap_lock;
+    bool tap_active;
+    char *tap_buf;
+    unsigned int tap_head;
+    unsigned int tap_tail;
+    //Records that did not fit in tap_buf, reset on open
+    unsigned int tap_dropped;
+    wait_queue_head_t tap_waitQ;
+    //Adaptive RX mode. While rx_polling is set RDI is disabled and rx_poll_timer drains the
+    //FIFO instead of the IRQ handler. Only one of the two ever touches the RX side
+    bool rx_polling;
+    struct hrtimer rx_poll_timer;
+    unsigned int rx_idle_polls;
+    ktime_t rx_mode_since;
+    //Time RX_POLL_CHARS characters take at the current line settings, see rx_poll_update()
+    u64 rx_poll_ns;
+    //Tunables, see the module parameters of the same names
+    u32 poll_threshold;
+    u32 poll_interval_us;
+    u32 poll_idle_limit;
+    //Held by the platform device and every open file and mapping, which may outlive remove
+    struct kref ref;
+    //Set by remove, everything fails with -ENODEV from then on. Checked under read_protect
+    //or write_protect, which remove takes once after setting it, so no register is touched later
+    bool dead;
 };
 
 
@@ -90,18 +320,38 @@ static ssize_t uart_read(struct file *file, char __user *buf, size_t size, loff_
 //FOPS write
 static ssize_t uart_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos);
 
-//UART receive from another LKM
-ssize_t uart_receive(char *buf, size_t size);
+//FOPS ioctl
+static long uart_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+
+//FOPS poll
+static __poll_t uart_poll(struct file *file, poll_table *wait);
+
+//FOPS mmap
+static int uart_mmap(struct file *file, struct vm_area_struct *vma);
+
+//VMA open and close, keep track of user space mappings of the RX ring
+static void uart_vma_open(struct vm_area_struct *vma);
+static void uart_vma_close(struct vm_area_struct *vma);
+
+//Frees the device once its last reference is dropped
+static void uart_dev_release(struct kref *ref);
+
+//API for other LKMs, documented in uart_driver.h
+EXPORT_SYMBOL(uart_get);
+EXPORT_SYMBOL(uart_get_by_node);
+EXPORT_SYMBOL(uart_put);
 EXPORT_SYMBOL(uart_receive);
-//UART send from another LKM
-ssize_t uart_send(const char *buf, size_t len);
-EXPORT_SYMBOL(uart_send);
-//UART receive from another LKM
-ssize_t uart_receive_timeout(char *buf, size_t size,int msecs);
 EXPORT_SYMBOL(uart_receive_timeout);
-//Flush buffer contents
-void uart_flush_buffer(void);
+EXPORT_SYMBOL(uart_receive_until);
+EXPORT_SYMBOL(uart_receive_min);
+EXPORT_SYMBOL(uart_receive_timestamped);
+EXPORT_SYMBOL(uart_receive_deadline);
+EXPORT_SYMBOL(uart_send);
+EXPORT_SYMBOL(uart_send_flush);
+EXPORT_SYMBOL(uart_set_line);
 EXPORT_SYMBOL(uart_flush_buffer);
+EXPORT_SYMBOL(uart_register_rx_handler);
+EXPORT_SYMBOL(uart_unregister_rx_handler);
 
 //Routine to read from serial device registers
 static unsigned int reg_read(struct uart_serial_dev *dev, int offset);
@@ -109,17 +359,153 @@ static unsigned int reg_read(struct uart_serial_dev *dev, int offset);
 //Routine to write to serial device registers
 static void reg_write(struct uart_serial_dev *dev, int val, int offset);
 
-//Routine to write a character to the seriald device
-static void write_char(struct uart_serial_dev *dev, char test);
+//Register backend of the memory mapped AM335x UARTs
+static unsigned int mmio_reg_read(void *ctx, int offset);
+static void mmio_reg_write(void *ctx, unsigned int val, int offset);
+
+//Routine to queue data for transmission, expanding \n to \n\r unless in raw mode
+static ssize_t tx_enqueue(struct uart_serial_dev *dev, const char *buf, size_t len);
+
+//Routine to wait until the TX buffer and FIFO are empty
+static int tx_flush(struct uart_serial_dev *dev, long timeout);
+
+//Routine to set or clear bits of the IER register
+static void update_ier(struct uart_serial_dev *dev, unsigned int set, unsigned int clear);
+
+//Routine to refill the TX FIFO from the TX buffer on a THR empty interrupt
+static unsigned int fill_tx_fifo(struct uart_serial_dev *dev);
+
+//Routine to get the free space in the TX buffer
+static unsigned int tx_space(struct uart_serial_dev *dev);
+
+//Routine to program divisor, line format and FIFO control, fcr_flags are one-shot FCR bits
+static void program_line(struct uart_serial_dev *dev, unsigned int fcr_flags);
+
+//Routine to map an RX FIFO trigger level to its FCR bits, -EINVAL if unsupported
+static int rx_trigger_fcr_bits(unsigned int level);
+
+//Routine to change the RX FIFO trigger level
+static int set_rx_trigger(struct uart_serial_dev *dev, unsigned int level);
+
+//Routine to change baud rate, word length and parity
+static int set_line(struct uart_serial_dev *dev, const struct uart_line_config *line);
+
+//Routine to pick the divisor and MDR1 oversampling mode generating the rate closest to baud
+static unsigned int line_divisor(unsigned int uartclk, unsigned int baud, unsigned int *mdr1);
 
 //Interrupt handler
 static irqreturn_t irqHandler(int irq, void *devid);
 
-//Utility method to write to circular buffer
-static void write_circ_buff(char c, struct uart_serial_dev *dev);
+//Interrupt handler of serial_core ports
+static irqreturn_t uart_tty_irq(int irq, void *devid);
+
+//Utility methods of uart_tty_irq moving data between the FIFOs and the tty layer
+static void uart_tty_rx_chars(struct uart_serial_dev *dev, unsigned int lsr);
+static void uart_tty_tx_chars(struct uart_serial_dev *dev);
+
+//Register a probed UART with serial_core
+static int uart_tty_probe(struct uart_serial_dev *dev, struct platform_device *pdev, struct resource *res);
+
+//Routine to install the interrupt handler once the state it uses is initialised
+static int uart_request_irq(struct uart_serial_dev *dev, struct platform_device *pdev, irq_handler_t handler);
+
+//serial_core port operations
+static unsigned int uart_tty_tx_empty(struct uart_port *port);
+static void uart_tty_set_mctrl(struct uart_port *port, unsigned int mctrl);
+static unsigned int uart_tty_get_mctrl(struct uart_port *port);
+static void uart_tty_stop_tx(struct uart_port *port);
+static void uart_tty_start_tx(struct uart_port *port);
+static void uart_tty_stop_rx(struct uart_port *port);
+static void uart_tty_break_ctl(struct uart_port *port, int break_state);
+static int uart_tty_startup(struct uart_port *port);
+static void uart_tty_shutdown(struct uart_port *port);
+static void uart_tty_set_termios(struct uart_port *port, struct ktermios *termios, struct ktermios *old);
+static const char *uart_tty_type(struct uart_port *port);
+static void uart_tty_release_port(struct uart_port *port);
+static int uart_tty_request_port(struct uart_port *port);
+static void uart_tty_config_port(struct uart_port *port, int flags);
+static int uart_tty_verify_port(struct uart_port *port, struct serial_struct *ser);
+
+//Utility method to drain the RX FIFO into the circular buffer
+static unsigned int drain_rx_fifo(struct uart_serial_dev *dev, unsigned int lsr, ktime_t now);
+
+//Utility method to read LSR and account the error flags the read clears
+static unsigned int rx_read_lsr(struct uart_serial_dev *dev);
+
+//Utility method to hand a drained burst to the RX handler or wake up the reader
+static void rx_deliver(struct uart_serial_dev *dev, unsigned int old_head, unsigned int count);
+
+//Timer routine draining the RX FIFO in polling mode
+static enum hrtimer_restart rx_poll(struct hrtimer *timer);
+
+//Utility method to switch between interrupt and polling mode, called by the current RX producer
+static void rx_set_polling(struct uart_serial_dev *dev, bool polling);
+
+//Utility method to get the polling period, never below 10us whatever debugfs says
+static ktime_t rx_poll_interval(struct uart_serial_dev *dev);
+
+//Utility method to derive the polling period from the baud rate and frame format
+static void rx_poll_update(struct uart_serial_dev *dev);
+
+//Utility method to leave polling mode for good, with the IRQ disabled
+static void rx_poll_stop(struct uart_serial_dev *dev);
+
+//Utility method to remember the arrival time of the burst starting at start
+static void record_rx_burst(struct uart_serial_dev *dev, unsigned int start, ktime_t time);
+
+//Utility method to forget the arrival times of bursts that have been read up to tail
+static void retire_rx_bursts(struct uart_serial_dev *dev, unsigned int tail);
+
+//Utility method to get the number of bytes at the tail that arrived together, and when
+static unsigned int rx_burst_span(struct uart_serial_dev *dev, ktime_t *time);
+
+//Utility method to decide whether a drained burst satisfies the sleeping reader
+static bool rx_wake_needed(struct uart_serial_dev *dev, unsigned int old_head);
+
+//Utility method to get the number of bytes stored in the circular buffer
+static unsigned int circ_buff_length(struct uart_serial_dev *dev);
+
+//Utility method to find c between the from and to ring positions, returns to if not found
+static unsigned int circ_buff_find(struct uart_serial_dev *dev, char c, unsigned int from, unsigned int to);
+
+//Utility method to check if the delimiter arrived or size bytes are buffered
+static bool rx_delim_ready(struct uart_serial_dev *dev, char delim, size_t size, unsigned int *scanned);
+
+//Utility method to convert a msecs argument (negative means no limit) to a wait timeout
+static long msecs_to_timeout(int msecs);
+
+//Utility method to read up to size bytes from circular buff
+static size_t read_circ_buff(struct uart_serial_dev *dev, char *buf, size_t size);
+
+//Utility method to copy up to size bytes from circular buff straight to user space
+static ssize_t read_circ_buff_user(struct uart_serial_dev *dev, char __user *buf, size_t size);
 
-//Utility method to read from circular buff
-static char read_circ_buff(struct uart_serial_dev *dev);
+//Utility method to wait for at least min_bytes and read up to size bytes from circular buff
+static ssize_t receive_common(struct uart_serial_dev *dev, char *buf, size_t size, size_t min_bytes, long timeout);
+
+//Workqueue routine handing the received data to the registered RX handler
+static void rx_work_handler(struct work_struct *work);
+
+//Create the debugfs directory of a device and its counters
+static void uart_debugfs_init(struct uart_serial_dev *dev);
+
+//debugfs show routine of the RX buffer occupancy histogram
+static int rx_occupancy_show(struct seq_file *m, void *v);
+
+//Tap device FOPS
+static int uart_tap_open(struct inode *inode, struct file *file);
+static int uart_tap_release(struct inode *inode, struct file *file);
+static ssize_t uart_tap_read(struct file *file, char __user *buf, size_t size, loff_t *ppos);
+static __poll_t uart_tap_poll(struct file *file, poll_table *wait);
+
+//Utility method to mirror len bytes of ring, starting at position start, to the tap
+static void tap_record_ring(struct uart_serial_dev *dev, unsigned int dir, const struct circ_buff *ring, unsigned int start, unsigned int len);
+
+//Utility method to copy len bytes to the tap buffer at position head
+static void tap_copy(struct uart_serial_dev *dev, unsigned int head, const void *src, unsigned int len);
+
+//Utility method to read the bytes of one RX burst straight to user space, for UART_READ_TIMED
+static ssize_t read_timed_user(struct uart_serial_dev *dev, struct uart_timed_read *req, bool nonblock);
 
 //Device id struct
 static struct of_device_id uart_match_table[] =
@@ -129,391 +515,2360 @@ static struct of_device_id uart_match_table[] =
         },
 };
 
+//Devices that are not described by the device tree, see uart_model.c
+static const struct platform_device_id uart_id_table[] =
+    {
+        {
+            .name = UART_SERIAL_MODEL_NAME,
+        },
+        {},
+};
+
+static const struct uart_reg_ops mmio_reg_ops = {
+    .read = mmio_reg_read,
+    .write = mmio_reg_write,
+};
+
 //File operations struct
 static const struct file_operations uart_fops = {
     .owner = THIS_MODULE,
     .read = uart_read,
     .write = uart_write,
+    .unlocked_ioctl = uart_ioctl,
+    .poll = uart_poll,
+    .mmap = uart_mmap,
     .open = uart_open,
     .release = uart_close,
     .llseek = no_llseek,
 };
 
+static const struct file_operations uart_tap_fops = {
+    .owner = THIS_MODULE,
+    .read = uart_tap_read,
+    .poll = uart_tap_poll,
+    .open = uart_tap_open,
+    .release = uart_tap_release,
+    .llseek = no_llseek,
+};
+
+//Enabled while any tap device is open, so the hot paths pay nothing for the tap otherwise
+static DEFINE_STATIC_KEY_FALSE(uart_tap_key);
+
+//VMA operations of the mmap'ed RX ring
+static const struct vm_operations_struct uart_vm_ops = {
+    .open = uart_vma_open,
+    .close = uart_vma_close,
+};
+
 //Platform driver structure
 static struct platform_driver uart_plat_driver = {
     .driver = {
         .name = "serial",
         .owner = THIS_MODULE,
         .of_match_table = uart_match_table},
+    .id_table = uart_id_table,
     .probe = uart_probe,
     .remove = uart_remove
 };
 
-//Driver instance
-struct uart_serial_dev *hlm_dev;
+//Probed driver instances, looked up by uart_get()
+static LIST_HEAD(uart_devices);
+static DEFINE_MUTEX(uart_devices_lock);
+
+static const struct uart_ops uart_tty_ops = {
+    .tx_empty = uart_tty_tx_empty,
+    .set_mctrl = uart_tty_set_mctrl,
+    .get_mctrl = uart_tty_get_mctrl,
+    .stop_tx = uart_tty_stop_tx,
+    .start_tx = uart_tty_start_tx,
+    .stop_rx = uart_tty_stop_rx,
+    .break_ctl = uart_tty_break_ctl,
+    .startup = uart_tty_startup,
+    .shutdown = uart_tty_shutdown,
+    .set_termios = uart_tty_set_termios,
+    .type = uart_tty_type,
+    .release_port = uart_tty_release_port,
+    .request_port = uart_tty_request_port,
+    .config_port = uart_tty_config_port,
+    .verify_port = uart_tty_verify_port,
+};
+
+//ttyUS0-2 are uart1, uart4 and uart5, ttyUS3 a UART at an unknown address (e.g. the model)
+static struct uart_driver uart_tty_driver = {
+    .owner = THIS_MODULE,
+    .driver_name = "uart_serial",
+    .dev_name = "ttyUS",
+    .nr = UART_UNKNOWN + 1,
+};
+
+//Number of ports registered with uart_tty_driver, it is registered with the first one.
+//Protected by uart_devices_lock
+static unsigned int uart_tty_ports;
+
+//debugfs "uart_serial" directory, holding one directory per device. Protected by uart_devices_lock
+static struct dentry *uart_debugfs_root;
+
+DEFINE_SHOW_ATTRIBUTE(rx_occupancy);
 
 /*********************************************************/
 static int uart_open(struct inode *inode, struct file *file)
 {
+    struct miscdevice *mdev = (struct miscdevice *)file->private_data;
+    struct uart_serial_dev *dev = container_of(mdev, struct uart_serial_dev, mDev);
+    //misc_open() holds misc_mtx, so remove can not drop the probe reference meanwhile
+    kref_get(&dev->ref);
     return 0;
 }
 /*********************************************************/
 static int uart_close(struct inode *inodep, struct file *filp)
 {
+    struct miscdevice *mdev = (struct miscdevice *)filp->private_data;
+    struct uart_serial_dev *dev = container_of(mdev, struct uart_serial_dev, mDev);
+    kref_put(&dev->ref, uart_dev_release);
     return 0;
 }
 /*********************************************************/
 static ssize_t uart_read(struct file *file, char __user *buf, size_t size, loff_t *ppos)
 {
     struct miscdevice *mdev = (struct miscdevice *)file->private_data;
-    char ret;
     struct uart_serial_dev *dev = container_of(mdev, struct uart_serial_dev, mDev);
-    if(dev->this_uart_number == UART1)
+    ssize_t retval;
+    //The UART belongs to the LKM that claimed it
+    if(READ_ONCE(dev->claimed))
     {
-        return -EINVAL;
+        return -EBUSY;
+    }
+    if(size == 0)
+    {
+        return 0;
+    }
+    if(mutex_lock_interruptible(&dev->read_protect))
+    {
+        return -EINTR;
+    }
+    //A mapping owns the tail of the RX ring, read() would race with it. Checked under
+    //read_protect, which mmap() takes to switch modes
+    if(smp_load_acquire(&dev->rx_mapped))
+    {
+        retval = -EBUSY;
+        goto out;
+    }
+    if(dev->dead)
+    {
+        retval = -ENODEV;
+        goto out;
     }
-    spin_lock_irqsave(&dev->lock, dev->irqFlags);
-    while(dev->buf.length == 0)
+    if(circ_buff_length(dev) == 0)
     {
-        spin_unlock_irqrestore(&dev->lock, dev->irqFlags);
-        if(wait_event_interruptible(dev->waitQ, dev->buf.length > 0))
+        if(file->f_flags & O_NONBLOCK)
         {
-            return -EINTR;
+            retval = -EAGAIN;
+            goto out;
+        }
+        if(wait_event_interruptible(dev->waitQ, circ_buff_length(dev) > 0 || READ_ONCE(dev->dead)))
+        {
+            retval = -EINTR;
+            goto out;
+        }
+        if(dev->dead)
+        {
+            retval = -ENODEV;
+            goto out;
         }
-        spin_lock_irqsave(&dev->lock, dev->irqFlags);
     }
-    
-
-    ret = read_circ_buff(dev);
-    spin_unlock_irqrestore(&dev->lock, dev->irqFlags);
-    if(copy_to_user(buf, &ret, 1))
+    //Hand over everything buffered that fits, not just one byte
+    retval = read_circ_buff_user(dev, buf, size);
+    if(retval < 0)
     {
         printk("uart: cannot copy memory to the user.\n");
-        return 0;
     }
-    return 1;
+    out:
+        mutex_unlock(&dev->read_protect);
+        return retval;
 }
+
 /*********************************************************/
-static ssize_t uart_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos)
+static __poll_t uart_poll(struct file *file, poll_table *wait)
 {
     struct miscdevice *mdev = (struct miscdevice *)file->private_data;
     struct uart_serial_dev *dev = container_of(mdev, struct uart_serial_dev, mDev);
-    int i;
-    char *kmem;
-    ssize_t retval = 0;
-    if(dev->this_uart_number == UART1)
+    __poll_t mask = 0;
+    if(READ_ONCE(dev->claimed))
+    {
+        return EPOLLERR;
+    }
+    poll_wait(file, &dev->waitQ, wait);
+    poll_wait(file, &dev->tx_waitQ, wait);
+    if(READ_ONCE(dev->dead))
+    {
+        return EPOLLHUP | EPOLLERR;
+    }
+    if(circ_buff_length(dev) > 0)
+    {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if(tx_space(dev) >= 2)
+    {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    return mask;
+}
+
+/*********************************************************/
+static int uart_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct miscdevice *mdev = (struct miscdevice *)file->private_data;
+    struct uart_serial_dev *dev = container_of(mdev, struct uart_serial_dev, mDev);
+    unsigned long len = vma->vm_end - vma->vm_start;
+    int ret;
+    //Header page followed by the ring, always mapped from the start
+    if(vma->vm_pgoff != 0 || len > PAGE_SIZE + PAGE_ALIGN(dev->buf.size))
     {
         return -EINVAL;
     }
-    
-    kmem = kmalloc(sizeof(char)*(len + 1), GFP_KERNEL);
-    if(!kmem)
+    //The consumer hands space back by writing the tail, which a private mapping would
+    //copy on write: the driver would never see it move and drop everything from then on
+    if(!(vma->vm_flags & VM_SHARED))
     {
-        printk("uart: cannot allocate memory for a write operation.\n");
-        return 0;
+        return -EINVAL;
+    }
+    //Switching to mapped mode hands the tail over to user space, so no read() may be in flight.
+    //mmap_lock is held here and a reader may fault on it in copy_to_user() while holding
+    //read_protect, so never sleep on read_protect: a busy reader makes mmap() fail instead
+    if(!mutex_trylock(&dev->read_protect))
+    {
+        return -EBUSY;
     }
-    if(copy_from_user(kmem, buf, len))
+    mutex_lock(&uart_devices_lock);
+    if(dev->dead)
     {
-        printk("uart: cannot copy memory from the user.\n");
-        retval = 0;
+        ret = -ENODEV;
         goto out;
     }
-    if (mutex_lock_interruptible(&dev->write_protect))
+    if(dev->claimed)
     {
-        retval = -EINTR;
+        ret = -EBUSY;
         goto out;
     }
-    for (i = 0; i < len; i++)
+    ret = remap_vmalloc_range(vma, dev->rx_area, 0);
+    if(!ret)
     {
-        if (kmem[i] == '\n')
-        {
-            write_char(dev, '\n');
-            write_char(dev, '\r');
-        }
-        else
-        {
-            write_char(dev, kmem[i]);
-        }
+        vma->vm_private_data = dev;
+        vma->vm_ops = &uart_vm_ops;
+        dev->rx_mapped++;
+        //Dropped in uart_vma_close(), the mapping may outlive the file and the device
+        kref_get(&dev->ref);
     }
-    retval = len;
-    mutex_unlock(&dev->write_protect);
-    out: kfree(kmem);   
-         return retval;
+    out:
+        mutex_unlock(&uart_devices_lock);
+        mutex_unlock(&dev->read_protect);
+        return ret;
 }
 
-
 /*********************************************************/
-ssize_t uart_receive(char *buf, size_t size)
+static void uart_vma_open(struct vm_area_struct *vma)
 {
-    char ret;
-    spin_lock_irqsave(&hlm_dev->lock, hlm_dev->irqFlags);
-    while(hlm_dev->buf.length == 0)
-    {
-        spin_unlock_irqrestore(&hlm_dev->lock, hlm_dev->irqFlags);
-        if(wait_event_interruptible(hlm_dev->waitQ, hlm_dev->buf.length > 0))
-        {
-            return -EINTR;
-        }
-        spin_lock_irqsave(&hlm_dev->lock, hlm_dev->irqFlags);
-    }
-    
-
-    //An interesting approach is to sleep until a expected number of bytes is received
-
-    ret = read_circ_buff(hlm_dev);
-    spin_unlock_irqrestore(&hlm_dev->lock, hlm_dev->irqFlags);
-    *buf = ret;
-    
-    return 1;
+    //A copy of an existing mapping (fork, split), so the count never leaves zero here
+    struct uart_serial_dev *dev = vma->vm_private_data;
+    kref_get(&dev->ref);
+    mutex_lock(&uart_devices_lock);
+    dev->rx_mapped++;
+    mutex_unlock(&uart_devices_lock);
 }
 
-
-ssize_t uart_receive_timeout(char *buf, size_t size,int msecs)
+/*********************************************************/
+static void uart_vma_close(struct vm_area_struct *vma)
 {
-    char ret;
-    spin_lock_irqsave(&hlm_dev->lock, hlm_dev->irqFlags);
-    while(hlm_dev->buf.length == 0)
+    struct uart_serial_dev *dev = vma->vm_private_data;
+    //Called under mmap_lock, so read_protect can not be taken here (see uart_mmap()). No
+    //reader consumes while rx_mapped is non-zero, and the pages are already unmapped
+    mutex_lock(&uart_devices_lock);
+    if(dev->rx_mapped == 1)
     {
-        spin_unlock_irqrestore(&hlm_dev->lock, hlm_dev->irqFlags);
-        ret = wait_event_interruptible_timeout(hlm_dev->waitQ,hlm_dev->buf.length > 0,msecs_to_jiffies(msecs));
-        //timeout occurred but condition still evaluated to false
-        if(ret == 0)
-        {
-            goto out;
-        }
-        //-ERESTARTSYS occured
-        else if(ret < 0)
+        //Hand the tail back to read() in a sane state, whatever user space left in it
+        if(circ_buff_length(dev) > dev->buf.size)
         {
-            ret = -EINTR;
-            goto out;
+            smp_store_release(&dev->buf.hdr->tail, smp_load_acquire(&dev->rx_head));
         }
-        spin_lock_irqsave(&hlm_dev->lock, hlm_dev->irqFlags);
+        //The arrival times were not consumed along with the bytes while mapped
+        retire_rx_bursts(dev, dev->buf.hdr->tail);
     }
-    
-
-    //An interesting approach is to sleep until a expected number of bytes is received
-
-    ret = read_circ_buff(hlm_dev);
-    spin_unlock_irqrestore(&hlm_dev->lock, hlm_dev->irqFlags);
-    *buf = ret;
-
-    ret = 1;
-    out:
-        return ret;
+    //Publishes the tail to the next reader
+    smp_store_release(&dev->rx_mapped, dev->rx_mapped - 1);
+    mutex_unlock(&uart_devices_lock);
+    kref_put(&dev->ref, uart_dev_release);
 }
-
 /*********************************************************/
-ssize_t uart_send(const char *buf, size_t len)
+static int uart_tap_open(struct inode *inode, struct file *file)
 {
-    int i;
-    if (mutex_lock_interruptible(&hlm_dev->write_protect))
+    struct miscdevice *mdev = (struct miscdevice *)file->private_data;
+    struct uart_serial_dev *dev = container_of(mdev, struct uart_serial_dev, tapDev);
+    char *tap_buf;
+    //A single reader, so the tap buffer stays single-producer/single-consumer
+    if(test_and_set_bit(0, &dev->tap_busy))
     {
-        return -EINTR;
+        return -EBUSY;
     }
-    for (i = 0; i < len; i++)
+    tap_buf = kmalloc(TAP_BUFF_SIZE, GFP_KERNEL);
+    if(!tap_buf)
     {
-        if (buf[i] == '\n')
-        {
-            write_char(hlm_dev, '\n');
-            write_char(hlm_dev, '\r');
-        }
-        else
-        {
-            write_char(hlm_dev, buf[i]);
-        }
+        clear_bit(0, &dev->tap_busy);
+        return -ENOMEM;
     }
-    mutex_unlock(&hlm_dev->write_protect);
-    return len;
-}
-
-/*********************************************************/
-void uart_flush_buffer(void)
-{
-    spin_lock_irqsave(&hlm_dev->lock, hlm_dev->irqFlags);
-    hlm_dev->buf.read_pos = hlm_dev->buf.write_pos;
-    hlm_dev->buf.length = 0;
-    spin_unlock_irqrestore(&hlm_dev->lock, hlm_dev->irqFlags);
-}
-
-
-/*********************************************************/
-static unsigned int reg_read(struct uart_serial_dev *dev, int offset)
-{
-    unsigned int ret;
-    spin_lock_irqsave(&dev->lock, dev->irqFlags);
-    ret = ioread32(dev->regs + (4 * offset));
-    spin_unlock_irqrestore(&dev->lock, dev->irqFlags);
-    return ret;
+    //Dropped in uart_tap_release(), as for uart_open()
+    kref_get(&dev->ref);
+    dev->tap_buf = tap_buf;
+    dev->tap_head = 0;
+    dev->tap_tail = 0;
+    dev->tap_dropped = 0;
+    //Publishes the buffer before a recorder can see tap_active
+    spin_lock_irq(&dev->tap_lock);
+    dev->tap_active = true;
+    spin_unlock_irq(&dev->tap_lock);
+    static_branch_inc(&uart_tap_key);
+    return 0;
 }
 
 /*********************************************************/
-static void reg_write(struct uart_serial_dev *dev, int val, int offset)
+static int uart_tap_release(struct inode *inode, struct file *file)
 {
-    spin_lock_irqsave(&dev->lock, dev->irqFlags);
-    iowrite32(val, dev->regs + (4 * offset));
-    spin_unlock_irqrestore(&dev->lock, dev->irqFlags);
-    return;
+    struct miscdevice *mdev = (struct miscdevice *)file->private_data;
+    struct uart_serial_dev *dev = container_of(mdev, struct uart_serial_dev, tapDev);
+    static_branch_dec(&uart_tap_key);
+    //A recorder in flight on another CPU, in the IRQ handler or rx_poll_timer, holds tap_lock.
+    //Once it is released here none of them can touch the buffer any more
+    spin_lock_irq(&dev->tap_lock);
+    dev->tap_active = false;
+    spin_unlock_irq(&dev->tap_lock);
+    kfree(dev->tap_buf);
+    dev->tap_buf = NULL;
+    if(dev->tap_dropped)
+    {
+        dev_info(dev->parent, "%s: tap dropped %u records\n", __func__, dev->tap_dropped);
+    }
+    clear_bit(0, &dev->tap_busy);
+    kref_put(&dev->ref, uart_dev_release);
+    return 0;
 }
 
 /*********************************************************/
-static void write_char(struct uart_serial_dev *dev, char c)
+static ssize_t uart_tap_read(struct file *file, char __user *buf, size_t size, loff_t *ppos)
 {
-    unsigned int lsr = reg_read(dev, UART_LSR);
-    while (1)
+    struct miscdevice *mdev = (struct miscdevice *)file->private_data;
+    struct uart_serial_dev *dev = container_of(mdev, struct uart_serial_dev, tapDev);
+    unsigned int tail = dev->tap_tail;
+    unsigned int head, offset, first;
+    if(size == 0)
+    {
+        return 0;
+    }
+    head = smp_load_acquire(&dev->tap_head);
+    if(head == tail)
     {
-        if (lsr & UART_LSR_THRE)
+        if(file->f_flags & O_NONBLOCK)
         {
-            break;
+            return -EAGAIN;
         }
-        lsr = reg_read(dev, UART_LSR);
+        if(wait_event_interruptible(dev->tap_waitQ, smp_load_acquire(&dev->tap_head) != tail || READ_ONCE(dev->dead)))
+        {
+            return -EINTR;
+        }
+        head = smp_load_acquire(&dev->tap_head);
+        //Records taken before remove are still handed out
+        if(head == tail)
+        {
+            return -ENODEV;
+        }
+    }
+    //A plain byte stream of records, the reader splits it with the record headers
+    size = min_t(size_t, size, head - tail);
+    offset = tail & (TAP_BUFF_SIZE - 1);
+    first = min_t(size_t, size, TAP_BUFF_SIZE - offset);
+    if(copy_to_user(buf, &dev->tap_buf[offset], first) || copy_to_user(buf + first, dev->tap_buf, size - first))
+    {
+        return -EFAULT;
     }
-    reg_write(dev, c, UART_TX);
+    smp_store_release(&dev->tap_tail, tail + size);
+    return size;
 }
 
 /*********************************************************/
-static irqreturn_t irqHandler(int irq, void *d)
+static __poll_t uart_tap_poll(struct file *file, poll_table *wait)
 {
-    struct uart_serial_dev *dev = d;
-    do 
+    struct miscdevice *mdev = (struct miscdevice *)file->private_data;
+    struct uart_serial_dev *dev = container_of(mdev, struct uart_serial_dev, tapDev);
+    poll_wait(file, &dev->tap_waitQ, wait);
+    if(smp_load_acquire(&dev->tap_head) != dev->tap_tail)
     {
-        char recv = reg_read(dev, UART_RX);
-        write_circ_buff(recv, dev);
-        wake_up(&dev->waitQ);
+        return EPOLLIN | EPOLLRDNORM;
     }
-    while (reg_read(dev, UART_LSR) & UART_LSR_DR);
-    return IRQ_HANDLED;
+    if(READ_ONCE(dev->dead))
+    {
+        return EPOLLHUP;
+    }
+    return 0;
 }
 
 /*********************************************************/
-static void write_circ_buff(char c, struct uart_serial_dev *dev)
+static void tap_record_ring(struct uart_serial_dev *dev, unsigned int dir, const struct circ_buff *ring, unsigned int start, unsigned int len)
 {
-    spin_lock_irqsave(&dev->lock, dev->irqFlags);
-    if(dev->buf.length < BUFF_SIZE)
+    //Called for RX from the IRQ handler or rx_poll_timer and for TX from the IRQ handler,
+    //tap_lock makes them a single producer of the tap buffer
+    struct uart_tap_record rec;
+    unsigned int offset = start & (ring->size - 1);
+    unsigned int first = min(len, ring->size - offset);
+    unsigned long flags;
+    unsigned int head;
+    spin_lock_irqsave(&dev->tap_lock, flags);
+    if(!dev->tap_active)
+    {
+        spin_unlock_irqrestore(&dev->tap_lock, flags);
+        return;
+    }
+    head = dev->tap_head;
+    //Whole records or nothing, so the stream never gets out of sync
+    if(TAP_BUFF_SIZE - (head - smp_load_acquire(&dev->tap_tail)) < sizeof(rec) + len)
     {
-        dev->buf.buff[dev->buf.write_pos] = c;
-        dev->buf.write_pos = ((dev->buf.write_pos + 1) % BUFF_SIZE);
-        dev->buf.length++;
+        dev->tap_dropped++;
+        spin_unlock_irqrestore(&dev->tap_lock, flags);
+        return;
     }
-    spin_unlock_irqrestore(&dev->lock, dev->irqFlags);
+    rec.time_ns = ktime_get_ns();
+    rec.len = len;
+    rec.dir = dir;
+    rec.reserved = 0;
+    tap_copy(dev, head, &rec, sizeof(rec));
+    tap_copy(dev, head + sizeof(rec), &ring->buff[offset], first);
+    tap_copy(dev, head + sizeof(rec) + first, ring->buff, len - first);
+    smp_store_release(&dev->tap_head, head + sizeof(rec) + len);
+    spin_unlock_irqrestore(&dev->tap_lock, flags);
+    wake_up(&dev->tap_waitQ);
 }
 
 /*********************************************************/
-static char read_circ_buff(struct uart_serial_dev *dev)
+static void tap_copy(struct uart_serial_dev *dev, unsigned int head, const void *src, unsigned int len)
 {
-    char c;
-    
-    c = dev->buf.buff[dev->buf.read_pos];
-    dev->buf.buff[dev-> buf.read_pos] = '\0';
-    if(dev->buf.length > 0)
-    {
-        dev->buf.buff[dev->buf.read_pos] = '\0';
-        dev->buf.read_pos = ((dev->buf.read_pos + 1 ) % BUFF_SIZE);
-        dev->buf.length--;
-    }
-    
-    return c;
+    unsigned int offset = head & (TAP_BUFF_SIZE - 1);
+    unsigned int first = min(len, TAP_BUFF_SIZE - offset);
+    memcpy(&dev->tap_buf[offset], src, first);
+    memcpy(dev->tap_buf, (const char *)src + first, len - first);
 }
 
-
 /*********************************************************/
-static int uart_probe(struct platform_device *pdev)
+static ssize_t uart_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos)
 {
-    struct resource *res;
-    int ret, error;
-    //Configure the UART device
-    unsigned int baud_divisor;
-    unsigned int uartclk;
-    struct uart_serial_dev *dev;
-    res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-
-    if (!res)
+    struct miscdevice *mdev = (struct miscdevice *)file->private_data;
+    struct uart_serial_dev *dev = container_of(mdev, struct uart_serial_dev, mDev);
+    size_t written = 0;
+    ssize_t retval = 0;
+    //The UART belongs to the LKM that claimed it
+    if(READ_ONCE(dev->claimed))
     {
-        pr_err("%s: platform_get_resource returned NULL\n", __func__);
-        return -EINVAL;
+        return -EBUSY;
     }
-
-    dev = devm_kzalloc(&pdev->dev, sizeof(struct uart_serial_dev), GFP_KERNEL);
-    if (!dev)
+    if (mutex_lock_interruptible(&dev->write_protect))
     {
-        pr_err("%s: devm_kzalloc returned NULL\n", __func__);
-        return -ENOMEM;
+        return -EINTR;
     }
-    dev->regs = devm_ioremap_resource(&pdev->dev, res);
-
-    if (IS_ERR(dev->regs))
+    //Go through the fixed bounce buffer chunk by chunk, nothing is allocated per write
+    while(written < len)
     {
-        dev_err(&pdev->dev, "%s: Can not remap registers\n", __func__);
-        return PTR_ERR(dev->regs);
-    }
-    
-    //Configure interrupts
-    dev->irq = platform_get_irq(pdev, 0);
-	if (dev->irq < 0) {
-		dev_err(&pdev->dev, "%s: unable to get IRQ\n", __func__);
-		return dev->irq;
-	}
-	ret = devm_request_irq(&pdev->dev, dev->irq, irqHandler, 0, "uart_serial", dev);
-	if (ret < 0) 
+        size_t chunk = min_t(size_t, len - written, TX_CHUNK_SIZE);
+        if(copy_from_user(dev->tx_chunk, buf + written, chunk))
+        {
+            printk("uart: cannot copy memory from the user.\n");
+            retval = -EFAULT;
+            break;
+        }
+        retval = tx_enqueue(dev, dev->tx_chunk, chunk);
+        if(retval < 0)
+        {
+            break;
+        }
+        written += retval;
+        //Interrupted while waiting for room in the TX buffer
+        if(retval < chunk)
+        {
+            break;
+        }
+    }
+    mutex_unlock(&dev->write_protect);
+    //Report partial writes, errors only if nothing was queued
+    return written ? written : retval;
+}
+
+/*********************************************************/
+static long uart_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct miscdevice *mdev = (struct miscdevice *)file->private_data;
+    struct uart_serial_dev *dev = container_of(mdev, struct uart_serial_dev, mDev);
+    struct uart_irq_stats stats;
+    struct uart_line_config line;
+    struct uart_timed_read timed;
+    unsigned int level, raw;
+    long retval = 0;
+
+    if(_IOC_TYPE(cmd) != UART_IOC_MAGIC) 
+        return -EINVAL;
+
+    if(_IOC_NR(cmd) > UART_IOC_MAXNR) 
+        return -EINVAL;
+
+    switch(cmd)
+    {
+    case UART_SET_RX_TRIGGER:
+        if(get_user(level, (unsigned int __user *)arg))
+        {
+            return -EFAULT;
+        }
+        retval = set_rx_trigger(dev, level);
+        break;
+    case UART_GET_RX_TRIGGER:
+        if(put_user(dev->rx_trigger, (unsigned int __user *)arg))
+        {
+            retval = -EFAULT;
+        }
+        break;
+    case UART_GET_IRQ_STATS:
+        stats = dev->stats;
+        stats.rx_buffer_size = dev->buf.size;
+        if(copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+        {
+            retval = -EFAULT;
+        }
+        break;
+    case UART_SET_LINE:
+        if(copy_from_user(&line, (const void __user *)arg, sizeof(line)))
+        {
+            return -EFAULT;
+        }
+        retval = set_line(dev, &line);
+        break;
+    case UART_GET_LINE:
+        if(copy_to_user((void __user *)arg, &dev->line, sizeof(dev->line)))
+        {
+            retval = -EFAULT;
+        }
+        break;
+    case UART_SET_RAW:
+        if(get_user(raw, (unsigned int __user *)arg))
+        {
+            return -EFAULT;
+        }
+        //Takes effect from the next write, never in the middle of one
+        if(mutex_lock_interruptible(&dev->write_protect))
+        {
+            return -EINTR;
+        }
+        WRITE_ONCE(dev->tx_raw, raw != 0);
+        mutex_unlock(&dev->write_protect);
+        break;
+    case UART_GET_RAW:
+        raw = READ_ONCE(dev->tx_raw);
+        if(put_user(raw, (unsigned int __user *)arg))
+        {
+            retval = -EFAULT;
+        }
+        break;
+    case UART_READ_TIMED:
+        //Same ownership rules as read(), the mapping is checked in read_timed_user()
+        if(READ_ONCE(dev->claimed))
+        {
+            return -EBUSY;
+        }
+        if(copy_from_user(&timed, (const void __user *)arg, sizeof(timed)))
+        {
+            return -EFAULT;
+        }
+        retval = read_timed_user(dev, &timed, file->f_flags & O_NONBLOCK);
+        if(retval >= 0 && copy_to_user((void __user *)arg, &timed, sizeof(timed)))
+        {
+            retval = -EFAULT;
+        }
+        break;
+    default:
+        retval = -ENOTTY;
+        break;
+    }
+    return retval;
+}
+
+/*********************************************************/
+struct uart_serial_dev *uart_get(const char *name)
+{
+    struct uart_serial_dev *dev;
+    struct uart_serial_dev *ret = ERR_PTR(-ENODEV);
+    mutex_lock(&uart_devices_lock);
+    list_for_each_entry(dev, &uart_devices, node)
+    {
+        if((dev->name && strcmp(dev->name, name) == 0) || strcmp(dev->mDev.name, name) == 0)
+        {
+            ret = (dev->claimed || dev->rx_mapped) ? ERR_PTR(-EBUSY) : dev;
+            break;
+        }
+    }
+    if(!IS_ERR(ret))
+    {
+        ret->claimed = true;
+        //Dropped by uart_put(), the handle outlives a remove of the UART
+        kref_get(&ret->ref);
+    }
+    mutex_unlock(&uart_devices_lock);
+    return ret;
+}
+
+/*********************************************************/
+struct uart_serial_dev *uart_get_by_node(struct device_node *np)
+{
+    struct uart_serial_dev *dev;
+    struct uart_serial_dev *ret = ERR_PTR(-ENODEV);
+    //UARTs without a device tree node (e.g. the model) have a NULL of_node, never match them
+    if(!np)
+    {
+        return ret;
+    }
+    mutex_lock(&uart_devices_lock);
+    list_for_each_entry(dev, &uart_devices, node)
+    {
+        if(dev->parent->of_node == np)
+        {
+            ret = (dev->claimed || dev->rx_mapped) ? ERR_PTR(-EBUSY) : dev;
+            break;
+        }
+    }
+    if(!IS_ERR(ret))
+    {
+        ret->claimed = true;
+        //Dropped by uart_put(), the handle outlives a remove of the UART
+        kref_get(&ret->ref);
+    }
+    mutex_unlock(&uart_devices_lock);
+    return ret;
+}
+
+/*********************************************************/
+void uart_put(struct uart_serial_dev *dev)
+{
+    uart_unregister_rx_handler(dev);
+    mutex_lock(&uart_devices_lock);
+    dev->claimed = false;
+    mutex_unlock(&uart_devices_lock);
+    kref_put(&dev->ref, uart_dev_release);
+}
+
+/*********************************************************/
+ssize_t uart_receive(struct uart_serial_dev *dev, char *buf, size_t size)
+{
+    return receive_common(dev, buf, size, 1, MAX_SCHEDULE_TIMEOUT);
+}
+
+/*********************************************************/
+ssize_t uart_receive_timeout(struct uart_serial_dev *dev, char *buf, size_t size, int msecs)
+{
+    return receive_common(dev, buf, size, 1, msecs_to_jiffies(msecs));
+}
+
+/*********************************************************/
+ssize_t uart_receive_min(struct uart_serial_dev *dev, char *buf, size_t size, size_t min_bytes, int msecs)
+{
+    return receive_common(dev, buf, size, min_bytes, msecs_to_timeout(msecs));
+}
+
+/*********************************************************/
+ssize_t uart_receive_until(struct uart_serial_dev *dev, char *buf, size_t size, char delim, int msecs)
+{
+    unsigned int scanned, found, head;
+    long ret;
+    if(size == 0)
+    {
+        return 0;
+    }
+    if(mutex_lock_interruptible(&dev->read_protect))
+    {
+        return -EINTR;
+    }
+    if(dev->dead)
+    {
+        ret = -ENODEV;
+        goto out;
+    }
+    if(dev->rx_handler)
+    {
+        ret = -EBUSY;
+        goto out;
+    }
+    scanned = dev->buf.hdr->tail;
+    //Wake on the delimiter, or once the caller's buffer could be filled completely
+    WRITE_ONCE(dev->rx_watermark, min_t(size_t, size, dev->buf.size));
+    WRITE_ONCE(dev->rx_delim, (unsigned char)delim);
+    //A single deadline covers the whole response, not every byte
+    ret = wait_event_interruptible_timeout(dev->waitQ, rx_delim_ready(dev, delim, size, &scanned) || READ_ONCE(dev->dead), msecs_to_timeout(msecs));
+    WRITE_ONCE(dev->rx_delim, -1);
+    WRITE_ONCE(dev->rx_watermark, 1);
+    //-ERESTARTSYS occured
+    if(ret < 0)
+    {
+        ret = -EINTR;
+        goto out;
+    }
+    if(dev->dead)
+    {
+        ret = -ENODEV;
+        goto out;
+    }
+    //Copy up to and including the delimiter. On timeout, hand back whatever has arrived so far
+    head = smp_load_acquire(&dev->rx_head);
+    found = circ_buff_find(dev, delim, dev->buf.hdr->tail, head);
+    if(found != head)
+    {
+        size = min_t(size_t, size, found - dev->buf.hdr->tail + 1);
+    }
+    ret = read_circ_buff(dev, buf, size);
+    out:
+        mutex_unlock(&dev->read_protect);
+        return ret;
+}
+
+/*********************************************************/
+static ssize_t read_circ_buff_user(struct uart_serial_dev *dev, char __user *buf, size_t size)
+{
+    //Caller holds read_protect. The IRQ handler never writes between tail and head,
+    //so the ring can be copied out directly without a bounce buffer
+    unsigned int tail = dev->buf.hdr->tail;
+    unsigned int offset = tail & (dev->buf.size - 1);
+    unsigned int avail = circ_buff_length(dev);
+    size_t first;
+    size = min_t(size_t, size, avail);
+    first = min_t(size_t, size, dev->buf.size - offset);
+    if(copy_to_user(buf, &dev->buf.buff[offset], first) || copy_to_user(buf + first, dev->buf.buff, size - first))
+    {
+        return -EFAULT;
+    }
+    smp_store_release(&dev->buf.hdr->tail, tail + size);
+    retire_rx_bursts(dev, tail + size);
+    trace_uart_rx_dequeue(dev->mDev.name, size, avail - size);
+    return size;
+}
+
+/*********************************************************/
+static ssize_t receive_common(struct uart_serial_dev *dev, char *buf, size_t size, size_t min_bytes, long timeout)
+{
+    long ret;
+    if(size == 0)
+    {
+        return 0;
+    }
+    //The buffer can never hold more than its size, so never wait for more than that
+    min_bytes = clamp_t(size_t, min_bytes, 1, min_t(size_t, size, dev->buf.size));
+    if(mutex_lock_interruptible(&dev->read_protect))
+    {
+        return -EINTR;
+    }
+    if(dev->dead)
+    {
+        ret = -ENODEV;
+        goto out;
+    }
+    //The data belongs to the RX handler
+    if(dev->rx_handler)
+    {
+        ret = -EBUSY;
+        goto out;
+    }
+    WRITE_ONCE(dev->rx_watermark, min_bytes);
+    ret = wait_event_interruptible_timeout(dev->waitQ, circ_buff_length(dev) >= min_bytes || READ_ONCE(dev->dead), timeout);
+    WRITE_ONCE(dev->rx_watermark, 1);
+    //-ERESTARTSYS occured
+    if(ret < 0)
+    {
+        ret = -EINTR;
+        goto out;
+    }
+    if(dev->dead)
+    {
+        ret = -ENODEV;
+        goto out;
+    }
+    //On timeout, hand back whatever has arrived so far (possibly nothing)
+    ret = read_circ_buff(dev, buf, size);
+    out:
+        mutex_unlock(&dev->read_protect);
+        return ret;
+}
+
+/*********************************************************/
+ssize_t uart_receive_timestamped(struct uart_serial_dev *dev, char *buf, size_t size, ktime_t *arrival, int msecs)
+{
+    long ret;
+    *arrival = 0;
+    if(size == 0)
+    {
+        return 0;
+    }
+    if(mutex_lock_interruptible(&dev->read_protect))
+    {
+        return -EINTR;
+    }
+    if(dev->dead)
+    {
+        ret = -ENODEV;
+        goto out;
+    }
+    if(dev->rx_handler)
+    {
+        ret = -EBUSY;
+        goto out;
+    }
+    ret = wait_event_interruptible_timeout(dev->waitQ, circ_buff_length(dev) > 0 || READ_ONCE(dev->dead), msecs_to_timeout(msecs));
+    //-ERESTARTSYS occured
+    if(ret < 0)
+    {
+        ret = -EINTR;
+        goto out;
+    }
+    if(dev->dead)
+    {
+        ret = -ENODEV;
+        goto out;
+    }
+    //Never mix bytes of different bursts, they would share one arrival time
+    ret = read_circ_buff(dev, buf, min_t(size_t, size, rx_burst_span(dev, arrival)));
+    out:
+        mutex_unlock(&dev->read_protect);
+        return ret;
+}
+
+/*********************************************************/
+ssize_t uart_receive_deadline(struct uart_serial_dev *dev, char *buf, size_t size, ktime_t deadline)
+{
+    //The buffer can never hold more than its size, so never wait for more than that
+    size_t wanted = min_t(size_t, size, dev->buf.size);
+    ktime_t left;
+    long ret;
+    if(size == 0)
+    {
+        return 0;
+    }
+    if(mutex_lock_interruptible(&dev->read_protect))
+    {
+        return -EINTR;
+    }
+    if(dev->dead)
+    {
+        ret = -ENODEV;
+        goto out;
+    }
+    if(dev->rx_handler)
+    {
+        ret = -EBUSY;
+        goto out;
+    }
+    //Only sleep if the deadline is still ahead, otherwise just take what is there
+    left = ktime_sub(deadline, ktime_get());
+    if(ktime_to_ns(left) > 0)
+    {
+        WRITE_ONCE(dev->rx_watermark, wanted);
+        ret = wait_event_interruptible_hrtimeout(dev->waitQ, circ_buff_length(dev) >= wanted || READ_ONCE(dev->dead), left);
+        WRITE_ONCE(dev->rx_watermark, 1);
+        //-ERESTARTSYS occured, -ETIME is the expected way out
+        if(ret == -ERESTARTSYS)
+        {
+            ret = -EINTR;
+            goto out;
+        }
+        if(dev->dead)
+        {
+            ret = -ENODEV;
+            goto out;
+        }
+    }
+    ret = read_circ_buff(dev, buf, size);
+    out:
+        mutex_unlock(&dev->read_protect);
+        return ret;
+}
+
+/*********************************************************/
+int uart_register_rx_handler(struct uart_serial_dev *dev, uart_rx_handler_t handler, void *priv)
+{
+    int ret = 0;
+    mutex_lock(&dev->read_protect);
+    if(dev->dead)
+    {
+        ret = -ENODEV;
+        goto out;
+    }
+    if(dev->rx_handler)
+    {
+        ret = -EBUSY;
+        goto out;
+    }
+    dev->rx_handler_priv = priv;
+    WRITE_ONCE(dev->rx_handler, handler);
+    //Hand over whatever arrived before registration right away
+    queue_work(system_highpri_wq, &dev->rx_work);
+    out:
+        mutex_unlock(&dev->read_protect);
+        return ret;
+}
+
+/*********************************************************/
+void uart_unregister_rx_handler(struct uart_serial_dev *dev)
+{
+    mutex_lock(&dev->read_protect);
+    WRITE_ONCE(dev->rx_handler, NULL);
+    mutex_unlock(&dev->read_protect);
+    //rx_work takes read_protect, so it can only be waited for without it.
+    //A run that is still pending finds no handler and leaves the data alone
+    cancel_work_sync(&dev->rx_work);
+}
+
+/*********************************************************/
+static void rx_work_handler(struct work_struct *work)
+{
+    struct uart_serial_dev *dev = container_of(work, struct uart_serial_dev, rx_work);
+    unsigned int tail, head;
+    mutex_lock(&dev->read_protect);
+    if(!dev->rx_handler)
+    {
+        goto out;
+    }
+    tail = dev->buf.hdr->tail;
+    head = smp_load_acquire(&dev->rx_head);
+    //Straight from the ring, one call per burst so each carries the arrival time of its
+    //bytes, split once more where the data wraps around. Bytes arriving meanwhile queue the work again
+    while(tail != head)
+    {
+        unsigned int offset = tail & (dev->buf.size - 1);
+        ktime_t arrival;
+        unsigned int len = min(head - tail, dev->buf.size - offset);
+        len = min(len, rx_burst_span(dev, &arrival));
+        dev->rx_handler(dev->rx_handler_priv, &dev->buf.buff[offset], len, arrival);
+        tail += len;
+        //Only now may the IRQ handler reuse the space
+        smp_store_release(&dev->buf.hdr->tail, tail);
+        trace_uart_rx_dequeue(dev->mDev.name, len, head - tail);
+    }
+    retire_rx_bursts(dev, tail);
+    out:
+        mutex_unlock(&dev->read_protect);
+}
+
+/*********************************************************/
+static ssize_t read_timed_user(struct uart_serial_dev *dev, struct uart_timed_read *req, bool nonblock)
+{
+    ktime_t arrival;
+    ssize_t retval;
+    if(req->len == 0)
+    {
+        return 0;
+    }
+    if(mutex_lock_interruptible(&dev->read_protect))
+    {
+        return -EINTR;
+    }
+    if(smp_load_acquire(&dev->rx_mapped))
+    {
+        retval = -EBUSY;
+        goto out;
+    }
+    if(dev->dead)
+    {
+        retval = -ENODEV;
+        goto out;
+    }
+    if(circ_buff_length(dev) == 0)
+    {
+        if(nonblock)
+        {
+            retval = -EAGAIN;
+            goto out;
+        }
+        if(wait_event_interruptible(dev->waitQ, circ_buff_length(dev) > 0 || READ_ONCE(dev->dead)))
+        {
+            retval = -EINTR;
+            goto out;
+        }
+        if(dev->dead)
+        {
+            retval = -ENODEV;
+            goto out;
+        }
+    }
+    retval = read_circ_buff_user(dev, (char __user *)req->buf, min_t(size_t, req->len, rx_burst_span(dev, &arrival)));
+    if(retval >= 0)
+    {
+        req->len = retval;
+        req->arrival_ns = ktime_to_ns(arrival);
+    }
+    out:
+        mutex_unlock(&dev->read_protect);
+        return retval;
+}
+
+/*********************************************************/
+ssize_t uart_send(struct uart_serial_dev *dev, const char *buf, size_t len)
+{
+    ssize_t ret;
+    if (mutex_lock_interruptible(&dev->write_protect))
+    {
+        return -EINTR;
+    }
+    ret = tx_enqueue(dev, buf, len);
+    mutex_unlock(&dev->write_protect);
+    return ret;
+}
+
+/*********************************************************/
+int uart_send_flush(struct uart_serial_dev *dev, int msecs)
+{
+    int ret;
+    //tx_flush() reads LSR, remove must not unmap the registers meanwhile
+    if(mutex_lock_interruptible(&dev->write_protect))
+    {
+        return -EINTR;
+    }
+    ret = tx_flush(dev, msecs_to_timeout(msecs));
+    mutex_unlock(&dev->write_protect);
+    return ret;
+}
+
+/*********************************************************/
+int uart_set_line(struct uart_serial_dev *dev, unsigned int baud, unsigned int word_length, unsigned int parity)
+{
+    struct uart_line_config line = {baud, word_length, parity};
+    return set_line(dev, &line);
+}
+
+/*********************************************************/
+static int tx_flush(struct uart_serial_dev *dev, long timeout)
+{
+    long ret;
+    //Caller holds write_protect
+    ret = wait_event_interruptible_timeout(dev->tx_waitQ, !(READ_ONCE(dev->ier) & UART_IER_THRI) || READ_ONCE(dev->dead), timeout);
+    if(ret < 0)
+    {
+        return -EINTR;
+    }
+    else if(ret == 0)
+    {
+        return -ETIMEDOUT;
+    }
+    if(dev->dead)
+    {
+        return -ENODEV;
+    }
+    //The FIFO is empty, wait for the last byte to leave the shift register (one character time)
+    while(1)
+    {
+        unsigned long flags;
+        unsigned int lsr;
+        spin_lock_irqsave(&dev->rx_lock, flags);
+        lsr = rx_read_lsr(dev);
+        spin_unlock_irqrestore(&dev->rx_lock, flags);
+        if(lsr & UART_LSR_TEMT)
+        {
+            return 0;
+        }
+        usleep_range(50, 100);
+    }
+}
+
+/*********************************************************/
+static ssize_t tx_enqueue(struct uart_serial_dev *dev, const char *buf, size_t len)
+{
+    size_t i = 0;
+    bool raw = READ_ONCE(dev->tx_raw);
+    ktime_t start;
+    int ret;
+    //Caller holds write_protect, so this is the only producer of tx_buf
+    while(1)
+    {
+        unsigned int old_head = dev->tx_buf.hdr->head;
+        unsigned int head = old_head;
+        unsigned int tail = smp_load_acquire(&dev->tx_buf.hdr->tail);
+        if(dev->dead)
+        {
+            return i ? i : -ENODEV;
+        }
+        //Keep room for the worst case of a \n expanded to \n\r
+        while(i < len && TX_BUFF_SIZE - (head - tail) >= 2)
+        {
+            dev->tx_buf.buff[head++ & (TX_BUFF_SIZE - 1)] = buf[i];
+            if(buf[i] == '\n' && !raw)
+            {
+                dev->tx_buf.buff[head++ & (TX_BUFF_SIZE - 1)] = '\r';
+            }
+            i++;
+        }
+        smp_store_release(&dev->tx_buf.hdr->head, head);
+        trace_uart_tx_enqueue(dev->mDev.name, head - old_head, head - tail);
+        //The THR empty interrupt fires right away and starts draining the buffer
+        update_ier(dev, UART_IER_THRI, 0);
+        if(i == len)
+        {
+            return len;
+        }
+        start = ktime_get();
+        ret = wait_event_interruptible(dev->tx_waitQ, tx_space(dev) >= 2 || READ_ONCE(dev->dead));
+        dev->dbg.tx_stalls++;
+        dev->dbg.tx_stall_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+        if(ret)
+        {
+            return i ? i : -EINTR;
+        }
+    }
+}
+
+/*********************************************************/
+static unsigned int tx_space(struct uart_serial_dev *dev)
+{
+    return TX_BUFF_SIZE - (dev->tx_buf.hdr->head - smp_load_acquire(&dev->tx_buf.hdr->tail));
+}
+
+/*********************************************************/
+static void update_ier(struct uart_serial_dev *dev, unsigned int set, unsigned int clear)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&dev->lock, flags);
+    WRITE_ONCE(dev->ier, (dev->ier | set) & ~clear);
+    reg_write(dev, dev->ier, UART_IER);
+    spin_unlock_irqrestore(&dev->lock, flags);
+}
+
+/*********************************************************/
+static unsigned int fill_tx_fifo(struct uart_serial_dev *dev)
+{
+    unsigned int tail = dev->tx_buf.hdr->tail;
+    unsigned int head = smp_load_acquire(&dev->tx_buf.hdr->head);
+    unsigned int count = 0;
+    unsigned long flags;
+    //Only called with LSR THRE set, which on this UART means the whole FIFO is empty
+    //(not just below the TX trigger level), see also UART_OMAP_SCR_TX_EMPTY
+    while(tail != head && count < TX_FIFO_SIZE)
     {
-		dev_err(&pdev->dev, "%s: unable to request IRQ %d (%d)\n", __func__, dev->irq, ret);
-		return ret;
-	}
-    spin_lock_init(&dev->lock); 
-    mutex_init(&dev->write_protect);
-    dev->buf.read_pos = 0;
-    dev->buf.write_pos = 0;
-    dev->buf.buff[0] = '\0';
-    dev->buf.length = 0;
-    init_waitqueue_head(&dev->waitQ);
-    
+        reg_write(dev, dev->tx_buf.buff[tail & (TX_BUFF_SIZE - 1)], UART_TX);
+        tail++;
+        count++;
+    }
+    //Before the bytes are handed back to the writers
+    if(static_branch_unlikely(&uart_tap_key) && count)
+    {
+        tap_record_ring(dev, UART_TAP_TX, &dev->tx_buf, tail - count, count);
+    }
+    smp_store_release(&dev->tx_buf.hdr->tail, tail);
+    dev->dbg.tx_bytes += count;
+    trace_uart_tx_dequeue(dev->mDev.name, count, head - tail);
+    if(tail == head)
+    {
+        //Re-check under the lock, so a writer enabling THRI after queueing more data is never lost
+        spin_lock_irqsave(&dev->lock, flags);
+        if(tail == smp_load_acquire(&dev->tx_buf.hdr->head) && count == 0)
+        {
+            WRITE_ONCE(dev->ier, dev->ier & ~UART_IER_THRI);
+            reg_write(dev, dev->ier, UART_IER);
+            trace_uart_tx_done(dev->mDev.name);
+        }
+        spin_unlock_irqrestore(&dev->lock, flags);
+    }
+    dev->dbg.tx_wakeups++;
+    trace_uart_wakeup(dev->mDev.name, true);
+    wake_up(&dev->tx_waitQ);
+    return count;
+}
 
-    //Enable power management runtime
-    pm_runtime_enable(&pdev->dev);
-    pm_runtime_get_sync(&pdev->dev);
+/*********************************************************/
+void uart_flush_buffer(struct uart_serial_dev *dev)
+{
+    //Flushing moves the tail, so it is a consumer operation
+    mutex_lock(&dev->read_protect);
+    smp_store_release(&dev->buf.hdr->tail, smp_load_acquire(&dev->rx_head));
+    retire_rx_bursts(dev, dev->buf.hdr->tail);
+    mutex_unlock(&dev->read_protect);
+}
+
+
+/*********************************************************/
+static unsigned int reg_read(struct uart_serial_dev *dev, int offset)
+{
+    //A single register access is atomic, no lock needed
+    return dev->ops->read(dev->reg_ctx, offset);
+}
+
+/*********************************************************/
+static void reg_write(struct uart_serial_dev *dev, int val, int offset)
+{
+    dev->ops->write(dev->reg_ctx, val, offset);
+}
+
+/*********************************************************/
+static unsigned int mmio_reg_read(void *ctx, int offset)
+{
+    struct uart_serial_dev *dev = ctx;
+    return ioread32(dev->regs + (4 * offset));
+}
+
+/*********************************************************/
+static void mmio_reg_write(void *ctx, unsigned int val, int offset)
+{
+    struct uart_serial_dev *dev = ctx;
+    iowrite32(val, dev->regs + (4 * offset));
+}
+
+/*********************************************************/
+static void program_line(struct uart_serial_dev *dev, unsigned int fcr_flags)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&dev->lock, flags);
+    reg_write(dev, UART_OMAP_MDR1_DISABLE, UART_OMAP_MDR1);
+    //The FIFO control bits can only be changed while the baud clock is stopped
+    reg_write(dev, UART_LCR_DLAB, UART_LCR);
+    reg_write(dev, 0x00, UART_DLL);
+    reg_write(dev, 0x00, UART_DLM);
+    reg_write(dev, dev->lcr, UART_LCR);
+    reg_write(dev, dev->fcr | fcr_flags, UART_FCR);
+    reg_write(dev, UART_LCR_DLAB, UART_LCR);
+    reg_write(dev, dev->divisor & 0xff, UART_DLL);
+    reg_write(dev, (dev->divisor >> 8) & 0xff, UART_DLM);
+    reg_write(dev, dev->lcr, UART_LCR);
+    reg_write(dev, UART_OMAP_SCR_TX_EMPTY, UART_OMAP_SCR);
+
+    reg_write(dev, dev->mdr1, UART_OMAP_MDR1);
+    spin_unlock_irqrestore(&dev->lock, flags);
+}
+
+/*********************************************************/
+static int rx_trigger_fcr_bits(unsigned int level)
+{
+    int i;
+    for(i = 0; i < ARRAY_SIZE(rx_trigger_levels); i++)
+    {
+        if(rx_trigger_levels[i].level == level)
+        {
+            return rx_trigger_levels[i].fcr_bits;
+        }
+    }
+    return -EINVAL;
+}
+
+/*********************************************************/
+static int set_rx_trigger(struct uart_serial_dev *dev, unsigned int level)
+{
+    int fcr_bits = rx_trigger_fcr_bits(level);
+    if(fcr_bits < 0)
+    {
+        return fcr_bits;
+    }
+    //Keep writers out and the IRQ handler away from the registers while DLAB is set.
+    //The FIFOs are not cleared, so no received data is lost.
+    if(mutex_lock_interruptible(&dev->write_protect))
+    {
+        return -EINTR;
+    }
+    if(dev->dead)
+    {
+        mutex_unlock(&dev->write_protect);
+        return -ENODEV;
+    }
+    disable_irq(dev->irq);
+    rx_poll_stop(dev);
+    dev->fcr = (dev->fcr & ~UART_FCR_TRIGGER_MASK) | fcr_bits;
+    dev->rx_trigger = level;
+    program_line(dev, 0);
+    enable_irq(dev->irq);
+    mutex_unlock(&dev->write_protect);
+    return 0;
+}
+
+/*********************************************************/
+static int set_line(struct uart_serial_dev *dev, const struct uart_line_config *line)
+{
+    unsigned int divisor, mdr1, actual, lcr;
+    int ret;
+    if(line->baud == 0 || line->baud > dev->uartclk / 13 || line->word_length < 5 || line->word_length > 8 || line->parity > UART_PARITY_EVEN)
+    {
+        return -EINVAL;
+    }
+    divisor = line_divisor(dev->uartclk, line->baud, &mdr1);
+    if(divisor == 0 || divisor > 0xffff)
+    {
+        return -EINVAL;
+    }
+    //Refuse rates neither oversampling mode can generate within 3%, the peer would see framing errors
+    actual = dev->uartclk / (mdr1 == UART_OMAP_MDR1_13X_MODE ? 13 : 16) / divisor;
+    if(abs((int)actual - (int)line->baud) * 100 > line->baud * 3)
+    {
+        return -EINVAL;
+    }
+    lcr = UART_LCR_WLEN5 + (line->word_length - 5);
+    if(line->parity != UART_PARITY_NONE)
+    {
+        lcr |= UART_LCR_PARITY;
+    }
+    if(line->parity == UART_PARITY_EVEN)
+    {
+        lcr |= UART_LCR_EPAR;
+    }
+    if(mutex_lock_interruptible(&dev->write_protect))
+    {
+        return -EINTR;
+    }
+    //Let queued data leave at the old rate before switching
+    ret = tx_flush(dev, msecs_to_jiffies(1000));
+    if(ret)
+    {
+        goto out;
+    }
+    disable_irq(dev->irq);
+    rx_poll_stop(dev);
+    dev->divisor = divisor;
+    dev->mdr1 = mdr1;
+    dev->lcr = lcr;
+    dev->line = *line;
+    rx_poll_update(dev);
+    //Anything still in the FIFOs was framed at the old rate
+    program_line(dev, UART_FCR_CLEAR_RCVR | UART_FCR_CLEAR_XMIT);
+    enable_irq(dev->irq);
+    out:
+        mutex_unlock(&dev->write_protect);
+        return ret;
+}
+
+/*********************************************************/
+static unsigned int line_divisor(unsigned int uartclk, unsigned int baud, unsigned int *mdr1)
+{
+    unsigned int div16 = DIV_ROUND_CLOSEST(uartclk, 16 * baud);
+    unsigned int div13 = DIV_ROUND_CLOSEST(uartclk, 13 * baud);
+    int err16 = div16 ? abs((int)(uartclk / 16 / div16) - (int)baud) : INT_MAX;
+    int err13 = div13 ? abs((int)(uartclk / 13 / div13) - (int)baud) : INT_MAX;
+    //Same choice as omap-serial, 16x unless 13x is strictly closer. At 48MHz 13x is
+    //what makes 460800 and 921600 usable, 16x is 7% and 8.5% off there
+    if(err13 < err16)
+    {
+        *mdr1 = UART_OMAP_MDR1_13X_MODE;
+        return div13;
+    }
+    *mdr1 = UART_OMAP_MDR1_16X_MODE;
+    return div16;
+}
+
+/*********************************************************/
+static irqreturn_t irqHandler(int irq, void *d)
+{
+    struct uart_serial_dev *dev = d;
+    //Reading IIR acknowledges a THR interrupt. RX has priority in IIR, so it can not tell
+    //whether TX needs a refill too, that is left to LSR THRE below
+    unsigned int iir = reg_read(dev, UART_IIR);
+    unsigned int old_head, lsr;
+    unsigned int rx_count = 0;
+    unsigned int tx_count = 0;
+    if(iir & UART_IIR_NO_INT)
+    {
+        return IRQ_NONE;
+    }
+    //rx_poll_timer may be reading LSR on another CPU while the THR interrupt runs
+    spin_lock(&dev->rx_lock);
+    old_head = dev->rx_head;
+    lsr = rx_read_lsr(dev);
+    trace_uart_irq_entry(dev->mDev.name, lsr);
+    dev->stats.irq_count++;
+    //In polling mode the RX FIFO belongs to rx_poll_timer
+    if((lsr & UART_LSR_DR) && !smp_load_acquire(&dev->rx_polling))
+    {
+        dev->stats.rx_irq_count++;
+        rx_count = drain_rx_fifo(dev, lsr, ktime_get());
+    }
+    spin_unlock(&dev->rx_lock);
+    if(rx_count)
+    {
+        rx_deliver(dev, old_head, rx_count);
+        //A burst this big means the line is busy, polling is cheaper than interrupts
+        if(READ_ONCE(dev->poll_threshold) && rx_count >= READ_ONCE(dev->poll_threshold))
+        {
+            rx_set_polling(dev, true);
+        }
+    }
+    if((lsr & UART_LSR_THRE) && (READ_ONCE(dev->ier) & UART_IER_THRI))
+    {
+        tx_count = fill_tx_fifo(dev);
+    }
+    trace_uart_irq_exit(dev->mDev.name, rx_count, tx_count);
+    return IRQ_HANDLED;
+}
+
+/*********************************************************/
+static void rx_deliver(struct uart_serial_dev *dev, unsigned int old_head, unsigned int count)
+{
+    //A registered RX handler takes every byte, readers only get woken
+    //up once per drained burst, and only if they can make progress
+    if(count && READ_ONCE(dev->rx_handler))
+    {
+        queue_work(system_highpri_wq, &dev->rx_work);
+    }
+    else if(count && rx_wake_needed(dev, old_head))
+    {
+        dev->dbg.rx_wakeups++;
+        trace_uart_wakeup(dev->mDev.name, false);
+        wake_up(&dev->waitQ);
+    }
+}
+
+/*********************************************************/
+static enum hrtimer_restart rx_poll(struct hrtimer *timer)
+{
+    struct uart_serial_dev *dev = container_of(timer, struct uart_serial_dev, rx_poll_timer);
+    unsigned int old_head, lsr;
+    unsigned int count = 0;
+    unsigned long flags;
+    //The IRQ handler still runs for TX and reads LSR too
+    spin_lock_irqsave(&dev->rx_lock, flags);
+    old_head = dev->rx_head;
+    lsr = rx_read_lsr(dev);
+    if(lsr & UART_LSR_DR)
+    {
+        count = drain_rx_fifo(dev, lsr, ktime_get());
+    }
+    spin_unlock_irqrestore(&dev->rx_lock, flags);
+    rx_deliver(dev, old_head, count);
+    if(count)
+    {
+        dev->rx_idle_polls = 0;
+    }
+    //The line went quiet, wait for the next burst with the interrupt again
+    else if(++dev->rx_idle_polls >= READ_ONCE(dev->poll_idle_limit))
+    {
+        rx_set_polling(dev, false);
+        return HRTIMER_NORESTART;
+    }
+    hrtimer_forward_now(timer, rx_poll_interval(dev));
+    return HRTIMER_RESTART;
+}
+
+/*********************************************************/
+static void rx_set_polling(struct uart_serial_dev *dev, bool polling)
+{
+    ktime_t now = ktime_get();
+    u64 elapsed = ktime_to_ns(ktime_sub(now, dev->rx_mode_since));
+    dev->rx_mode_since = now;
+    if(polling)
+    {
+        dev->dbg.rx_irq_mode_ns += elapsed;
+        dev->dbg.rx_poll_entries++;
+        dev->rx_idle_polls = 0;
+        //The IRQ handler stops draining before the timer can start
+        smp_store_release(&dev->rx_polling, true);
+        update_ier(dev, 0, UART_IER_RDI);
+        hrtimer_start(&dev->rx_poll_timer, rx_poll_interval(dev), HRTIMER_MODE_REL);
+    }
+    else
+    {
+        dev->dbg.rx_poll_mode_ns += elapsed;
+        //The timer is done with the FIFO before the IRQ handler takes over
+        smp_store_release(&dev->rx_polling, false);
+        update_ier(dev, UART_IER_RDI, 0);
+    }
+}
+
+/*********************************************************/
+static ktime_t rx_poll_interval(struct uart_serial_dev *dev)
+{
+    //The FIFO must not fill up between two polls, so poll_interval_us is only an upper bound
+    u64 ns = min_t(u64, READ_ONCE(dev->rx_poll_ns), (u64)READ_ONCE(dev->poll_interval_us) * NSEC_PER_USEC);
+    return ns_to_ktime(max_t(u64, ns, 10 * NSEC_PER_USEC));
+}
+
+/*********************************************************/
+static void rx_poll_update(struct uart_serial_dev *dev)
+{
+    //Start bit, 5 to 8 data bits, optional parity bit, 1 or 2 stop bits
+    unsigned int bits = 1 + 5 + (dev->lcr & 0x03) + ((dev->lcr & UART_LCR_PARITY) ? 1 : 0) + ((dev->lcr & UART_LCR_STOP) ? 2 : 1);
+    //E.g. 2.8ms at 115200 baud (capped by poll_interval_us), 107us at 3000000 baud
+    WRITE_ONCE(dev->rx_poll_ns, div_u64((u64)RX_POLL_CHARS * bits * NSEC_PER_SEC, dev->line.baud));
+}
+
+/*********************************************************/
+static void rx_poll_stop(struct uart_serial_dev *dev)
+{
+    //Called with the IRQ disabled, so polling mode can not be entered again meanwhile
+    hrtimer_cancel(&dev->rx_poll_timer);
+    if(dev->rx_polling)
+    {
+        rx_set_polling(dev, false);
+    }
+}
+
+/*********************************************************/
+static bool rx_wake_needed(struct uart_serial_dev *dev, unsigned int old_head)
+{
+    unsigned int head = dev->rx_head;
+    int delim;
+    //Pairs with the barrier in prepare_to_wait(): either we see the reader's new
+    //watermark/delimiter, or the reader sees the new head before sleeping
+    smp_mb();
+    if(head - dev->buf.hdr->tail >= READ_ONCE(dev->rx_watermark))
+    {
+        return true;
+    }
+    delim = READ_ONCE(dev->rx_delim);
+    return delim >= 0 && circ_buff_find(dev, delim, old_head, head) != head;
+}
+
+/*********************************************************/
+static unsigned int drain_rx_fifo(struct uart_serial_dev *dev, unsigned int lsr, ktime_t now)
+{
+    unsigned int head = dev->rx_head;
+    unsigned int tail = smp_load_acquire(&dev->buf.hdr->tail);
+    unsigned int count = 0;
+    unsigned int occupancy;
+    //Caller holds rx_lock and has accounted the flags of lsr, those of the character
+    //at the top of the FIFO
+    do 
+    {
+        char recv = reg_read(dev, UART_RX);
+        dev->stats.rx_bytes++;
+        //Bytes are dropped when the buffer is full, but the FIFO is still drained
+        if(head - tail < dev->buf.size)
+        {
+            dev->buf.buff[head & (dev->buf.size - 1)] = recv;
+            head++;
+            count++;
+        }
+        else
+        {
+            dev->stats.rx_dropped++;
+        }
+        lsr = rx_read_lsr(dev);
+    }
+    while (lsr & UART_LSR_DR);
+    //The arrival time must be visible before the bytes it belongs to
+    if(count)
+    {
+        record_rx_burst(dev, head - count, now);
+    }
+    //Publish the whole burst to the consumer at once, and to a mapping of the ring
+    smp_store_release(&dev->rx_head, head);
+    smp_store_release(&dev->buf.hdr->head, head);
+    if(static_branch_unlikely(&uart_tap_key) && count)
+    {
+        tap_record_ring(dev, UART_TAP_RX, &dev->buf, head - count, count);
+    }
+    //A tail written by an mmap() consumer is not trusted to be sane
+    occupancy = head - tail;
+    trace_uart_rx_enqueue(dev->mDev.name, count, occupancy);
+    if(occupancy <= dev->buf.size)
+    {
+        if(occupancy > dev->stats.rx_high_watermark)
+        {
+            dev->stats.rx_high_watermark = occupancy;
+        }
+        dev->dbg.rx_occupancy[min_t(unsigned int, occupancy * RX_OCCUPANCY_BUCKETS / dev->buf.size, RX_OCCUPANCY_BUCKETS - 1)]++;
+    }
+    return count;
+}
+
+/*********************************************************/
+static unsigned int rx_read_lsr(struct uart_serial_dev *dev)
+{
+    //Caller holds rx_lock. OE, FE, PE and BI are cleared by the read, so this is the
+    //only place they are accounted
+    unsigned int lsr = reg_read(dev, UART_LSR);
+    if(lsr & UART_LSR_OE)
+    {
+        dev->stats.rx_overruns++;
+    }
+    if(lsr & UART_LSR_FE)
+    {
+        dev->dbg.rx_framing_errors++;
+    }
+    if(lsr & UART_LSR_PE)
+    {
+        dev->dbg.rx_parity_errors++;
+    }
+    if(lsr & UART_LSR_BI)
+    {
+        dev->dbg.rx_breaks++;
+    }
+    return lsr;
+}
+
+/*********************************************************/
+static void record_rx_burst(struct uart_serial_dev *dev, unsigned int start, ktime_t time)
+{
+    unsigned int head = dev->burst_head;
+    //When full, the bytes are accounted to the previous burst until the consumer catches up.
+    //Only short bursts (RX timeouts, polls) can get there, counted in rx_burst_merges
+    if(head - smp_load_acquire(&dev->burst_tail) < dev->bursts_size)
+    {
+        dev->bursts[head & (dev->bursts_size - 1)].start = start;
+        dev->bursts[head & (dev->bursts_size - 1)].time = time;
+        smp_store_release(&dev->burst_head, head + 1);
+    }
+    else
+    {
+        dev->dbg.rx_burst_merges++;
+    }
+}
+
+/*********************************************************/
+static void retire_rx_bursts(struct uart_serial_dev *dev, unsigned int tail)
+{
+    unsigned int head = smp_load_acquire(&dev->burst_head);
+    unsigned int next = dev->burst_tail;
+    //Keep the burst holding the byte at tail, drop every one before it
+    while(head - next > 1 && (int)(tail - dev->bursts[(next + 1) & (dev->bursts_size - 1)].start) >= 0)
+    {
+        next++;
+    }
+    smp_store_release(&dev->burst_tail, next);
+}
+
+/*********************************************************/
+static unsigned int rx_burst_span(struct uart_serial_dev *dev, ktime_t *time)
+{
+    //Caller holds read_protect. The data head is loaded before the burst head,
+    //so every byte counted here already has its burst recorded
+    unsigned int tail = dev->buf.hdr->tail;
+    unsigned int len = circ_buff_length(dev);
+    unsigned int head, first;
+    struct rx_burst *cur;
+    retire_rx_bursts(dev, tail);
+    head = smp_load_acquire(&dev->burst_head);
+    first = dev->burst_tail;
+    *time = 0;
+    if(head == first)
+    {
+        return len;
+    }
+    cur = &dev->bursts[first & (dev->bursts_size - 1)];
+    //Bytes older than every recorded burst, e.g. left behind by an mmap() consumer
+    if((int)(tail - cur->start) < 0)
+    {
+        return min(len, cur->start - tail);
+    }
+    *time = cur->time;
+    if(head - first > 1)
+    {
+        len = min(len, dev->bursts[(first + 1) & (dev->bursts_size - 1)].start - tail);
+    }
+    return len;
+}
+
+/*********************************************************/
+static unsigned int circ_buff_length(struct uart_serial_dev *dev)
+{
+    return smp_load_acquire(&dev->rx_head) - dev->buf.hdr->tail;
+}
+
+/*********************************************************/
+static unsigned int circ_buff_find(struct uart_serial_dev *dev, char c, unsigned int from, unsigned int to)
+{
+    while(from != to)
+    {
+        unsigned int offset = from & (dev->buf.size - 1);
+        size_t chunk = min_t(size_t, to - from, dev->buf.size - offset);
+        char *found = memchr(&dev->buf.buff[offset], c, chunk);
+        if(found)
+        {
+            return from + (found - &dev->buf.buff[offset]);
+        }
+        from += chunk;
+    }
+    return to;
+}
+
+/*********************************************************/
+static bool rx_delim_ready(struct uart_serial_dev *dev, char delim, size_t size, unsigned int *scanned)
+{
+    unsigned int head = smp_load_acquire(&dev->rx_head);
+    if(head - dev->buf.hdr->tail >= min_t(size_t, size, dev->buf.size))
+    {
+        return true;
+    }
+    //Only scan the bytes that arrived since the last check
+    if(circ_buff_find(dev, delim, *scanned, head) != head)
+    {
+        return true;
+    }
+    *scanned = head;
+    return false;
+}
 
-    of_property_read_u32(pdev->dev.of_node, "clock-frequency", &uartclk);
+/*********************************************************/
+static long msecs_to_timeout(int msecs)
+{
+    return msecs < 0 ? MAX_SCHEDULE_TIMEOUT : msecs_to_jiffies(msecs);
+}
 
-    baud_divisor = uartclk / 16 / 115200;
+/*********************************************************/
+static size_t read_circ_buff(struct uart_serial_dev *dev, char *buf, size_t size)
+{
+    //Caller holds read_protect, so the tail can not move underneath us
+    unsigned int tail = dev->buf.hdr->tail;
+    unsigned int offset = tail & (dev->buf.size - 1);
+    unsigned int avail = circ_buff_length(dev);
+    size_t first;
+    size = min_t(size_t, size, avail);
+    //At most two copies: up to the end of the array, then from its start
+    first = min_t(size_t, size, dev->buf.size - offset);
+    memcpy(buf, &dev->buf.buff[offset], first);
+    memcpy(buf + first, dev->buf.buff, size - first);
+    smp_store_release(&dev->buf.hdr->tail, tail + size);
+    retire_rx_bursts(dev, tail + size);
+    trace_uart_rx_dequeue(dev->mDev.name, size, avail - size);
+    return size;
+}
 
-    reg_write(dev, UART_OMAP_MDR1_DISABLE, UART_OMAP_MDR1);
-    reg_write(dev, 0x00, UART_LCR);
-    reg_write(dev, UART_LCR_DLAB, UART_LCR);
-    reg_write(dev, baud_divisor & 0xff, UART_DLL);
-    reg_write(dev, (baud_divisor >> 8) & 0xff, UART_DLM);
-    reg_write(dev, UART_LCR_WLEN8, UART_LCR);
-    reg_write(dev, UART_FCR_CLEAR_RCVR | UART_FCR_CLEAR_XMIT | UART_FCR_ENABLE_FIFO, UART_FCR);
 
-    reg_write(dev, UART_OMAP_MDR1_16X_MODE, UART_OMAP_MDR1);
+/*********************************************************/
+static int uart_probe(struct platform_device *pdev)
+{
+    struct resource *res = NULL;
+    struct uart_serial_platform_data *pdata = dev_get_platdata(&pdev->dev);
+    int error;
+    //Configure the UART device
+    unsigned int uartclk = 0;
+    struct uart_serial_dev *dev;
 
-    switch(res->start)
+    //Not device managed, open files and mappings may keep it past remove
+    dev = kzalloc(sizeof(struct uart_serial_dev), GFP_KERNEL);
+    if (!dev)
+    {
+        pr_err("%s: kzalloc returned NULL\n", __func__);
+        return -ENOMEM;
+    }
+    kref_init(&dev->ref);
+    if (pdata)
+    {
+        //Registers behind a software backend, e.g. the UART model
+        dev->ops = pdata->ops;
+        dev->reg_ctx = pdata->ctx;
+        uartclk = pdata->uartclk;
+    }
+    else
+    {
+        res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+        if (!res)
+        {
+            pr_err("%s: platform_get_resource returned NULL\n", __func__);
+            error = -EINVAL;
+            goto out_put;
+        }
+        dev->regs = devm_ioremap_resource(&pdev->dev, res);
+        if (IS_ERR(dev->regs))
+        {
+            dev_err(&pdev->dev, "%s: Can not remap registers\n", __func__);
+            error = PTR_ERR(dev->regs);
+            goto out_put;
+        }
+        dev->ops = &mmio_reg_ops;
+        dev->reg_ctx = dev;
+        of_property_read_u32(pdev->dev.of_node, "clock-frequency", &uartclk);
+    }
+    
+    switch(res ? res->start : 0)
     {
         case 0x48022000:
             dev->this_uart_number = UART1;
-            hlm_dev = dev;
+            dev->name = "uart1";
             break;
         case 0x481a8000:
             dev->this_uart_number = UART4;
+            dev->name = "uart4";
             break;
         case 0x481aa000:
             dev->this_uart_number = UART5;
+            dev->name = "uart5";
+            break;
+        default:
+            dev->this_uart_number = UART_UNKNOWN;
             break;
     }
+    dev->tty = dev->this_uart_number != UART_UNKNOWN && tty[dev->this_uart_number];
+
+    //Configure interrupts
+    dev->irq = platform_get_irq(pdev, 0);
+	if (dev->irq < 0) {
+		dev_err(&pdev->dev, "%s: unable to get IRQ\n", __func__);
+		error = dev->irq;
+		goto out_put;
+	}
+    //The handler is installed only once the rings below exist, see uart_request_irq()
+    spin_lock_init(&dev->lock); 
+    spin_lock_init(&dev->rx_lock);
+    spin_lock_init(&dev->tap_lock);
+    mutex_init(&dev->write_protect);
+    mutex_init(&dev->read_protect);
+    dev->rx_watermark = 1;
+    dev->rx_delim = -1;
+    INIT_WORK(&dev->rx_work, rx_work_handler);
+    hrtimer_init(&dev->rx_poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    dev->rx_poll_timer.function = rx_poll;
+    dev->rx_mode_since = ktime_get();
+    dev->poll_threshold = poll_threshold;
+    dev->poll_interval_us = poll_interval_us;
+    dev->poll_idle_limit = poll_idle_limit;
+    init_waitqueue_head(&dev->waitQ);
+    init_waitqueue_head(&dev->tx_waitQ);
+    init_waitqueue_head(&dev->tap_waitQ);
+
+    //Enable power management runtime
+    pm_runtime_enable(&pdev->dev);
+    pm_runtime_get_sync(&pdev->dev);
+
+    dev->uartclk = uartclk;
+    dev->line.baud = 115200;
+    dev->line.word_length = 8;
+    dev->line.parity = UART_PARITY_NONE;
+    dev->divisor = line_divisor(uartclk, dev->line.baud, &dev->mdr1);
+    dev->lcr = UART_LCR_WLEN8;
+    rx_poll_update(dev);
+    dev->rx_trigger = rx_trigger;
+    error = rx_trigger_fcr_bits(rx_trigger);
+    if(error < 0)
+    {
+        dev_warn(&pdev->dev, "%s: invalid rx_trigger %u, using 8\n", __func__, rx_trigger);
+        dev->rx_trigger = 8;
+        error = UART_FCR_R_TRIG_00;
+    }
+    dev->fcr = UART_FCR_ENABLE_FIFO | error;
+    reg_write(dev, 0x00, UART_LCR);
+    //Mask whatever the bootloader left enabled until the handler can cope with it
+    reg_write(dev, 0x00, UART_IER);
+    program_line(dev, UART_FCR_CLEAR_RCVR | UART_FCR_CLEAR_XMIT);
+
+    if (dev->tty)
+    {
+        error = uart_tty_probe(dev, pdev, res);
+        if (error)
+        {
+            goto out_put;
+        }
+        return 0;
+    }
+
+    //Allocate the buffers, the RX one sized per UART
+    dev->buf.size = DEFAULT_RX_BUFF_SIZE;
+    if(dev->this_uart_number != UART_UNKNOWN)
+    {
+        dev->buf.size = roundup_pow_of_two(max_t(unsigned int, rx_buffer_size[dev->this_uart_number], MIN_RX_BUFF_SIZE));
+    }
+    //Zeroed and page aligned, so the header page and the ring can be mapped to user space
+    dev->rx_area = vmalloc_user(PAGE_SIZE + PAGE_ALIGN(dev->buf.size));
+    if (!dev->rx_area)
+    {
+        pr_err("%s: vmalloc_user returned NULL\n", __func__);
+        error = -ENOMEM;
+        goto out_put;
+    }
+    dev->buf.hdr = dev->rx_area;
+    dev->buf.hdr->size = dev->buf.size;
+    dev->buf.hdr->data_offset = PAGE_SIZE;
+    dev->buf.buff = dev->rx_area + PAGE_SIZE;
+    //One arrival time per burst of the lowest trigger level the buffer can hold
+    dev->bursts_size = roundup_pow_of_two(dev->buf.size / rx_trigger_levels[0].level);
+    dev->bursts = kcalloc(dev->bursts_size, sizeof(*dev->bursts), GFP_KERNEL);
+    dev->tx_buf.hdr = &dev->tx_hdr;
+    dev->tx_buf.size = TX_BUFF_SIZE;
+    dev->tx_buf.buff = kmalloc(dev->tx_buf.size, GFP_KERNEL);
+    dev->tx_chunk = kmalloc(TX_CHUNK_SIZE, GFP_KERNEL);
+    //The names are used by the tracepoints of files still open after remove
+    if (res)
+    {
+        dev->mDev.name = kasprintf(GFP_KERNEL, "uart_serial-%x", res->start);
+    }
+    else
+    {
+        dev->mDev.name = kasprintf(GFP_KERNEL, "%s", dev_name(&pdev->dev));
+    }
+    dev->tapDev.name = dev->mDev.name ? kasprintf(GFP_KERNEL, "%s-tap", dev->mDev.name) : NULL;
+    if (!dev->bursts || !dev->tx_buf.buff || !dev->tx_chunk || !dev->mDev.name || !dev->tapDev.name)
+    {
+        pr_err("%s: kmalloc returned NULL\n", __func__);
+        error = -ENOMEM;
+        goto out_put;
+    }
+    error = uart_request_irq(dev, pdev, irqHandler);
+    if (error < 0)
+    {
+        goto out_put;
+    }
     //Initialize and register a misc device
     dev->mDev.minor = MISC_DYNAMIC_MINOR;
-    dev->mDev.name = devm_kasprintf(&pdev->dev, GFP_KERNEL, "uart_serial-%x", res->start);
     dev->mDev.fops = &uart_fops;
     error = misc_register(&dev->mDev);
     if (error)
     {
         pr_err("%s: misc register failed.", __func__);
+        goto out_irq;
+    }
+
+    //The tap is a second misc device next to the UART, e.g. /dev/uart_serial-48022000-tap
+    dev->tapDev.minor = MISC_DYNAMIC_MINOR;
+    dev->tapDev.fops = &uart_tap_fops;
+    error = misc_register(&dev->tapDev);
+    if (error)
+    {
+        pr_err("%s: tap misc register failed.", __func__);
+        misc_deregister(&dev->mDev);
+        goto out_irq;
+    }
+
+    dev_set_drvdata(&pdev->dev, dev);
+    dev->parent = &pdev->dev;
+    mutex_lock(&uart_devices_lock);
+    list_add_tail(&dev->node, &uart_devices);
+    uart_debugfs_init(dev);
+    mutex_unlock(&uart_devices_lock);
+
+    //Enable RX interrupt, the TX interrupt is only enabled while there is data to send
+    update_ier(dev, UART_IER_RDI, 0);
+
+    return 0;
+    //The handler must be gone before the device it is given
+    out_irq:
+        devm_free_irq(&pdev->dev, dev->irq, dev);
+    out_put:
+        kref_put(&dev->ref, uart_dev_release);
         return error;
+}
+
+/*********************************************************/
+static void uart_dev_release(struct kref *ref)
+{
+    struct uart_serial_dev *dev = container_of(ref, struct uart_serial_dev, ref);
+    mutex_destroy(&dev->write_protect);
+    mutex_destroy(&dev->read_protect);
+    vfree(dev->rx_area);
+    kfree(dev->bursts);
+    kfree(dev->tx_buf.buff);
+    kfree(dev->tx_chunk);
+    kfree(dev->mDev.name);
+    kfree(dev->tapDev.name);
+    kfree(dev);
+}
+
+/*********************************************************/
+static int uart_request_irq(struct uart_serial_dev *dev, struct platform_device *pdev, irq_handler_t handler)
+{
+    //A pending interrupt left by the bootloader, or another device on a shared line,
+    //runs the handler straight away, so everything it touches must already be set up
+    int ret = devm_request_irq(&pdev->dev, dev->irq, handler, 0, "uart_serial", dev);
+    if (ret < 0)
+    {
+        dev_err(&pdev->dev, "%s: unable to request IRQ %d (%d)\n", __func__, dev->irq, ret);
+    }
+    return ret;
+}
+
+/*********************************************************/
+static void uart_debugfs_init(struct uart_serial_dev *dev)
+{
+    //Called with uart_devices_lock held. debugfs failures are not fatal, the
+    //debugfs_create_* calls simply do nothing when given an error pointer
+    if(!uart_debugfs_root)
+    {
+        uart_debugfs_root = debugfs_create_dir("uart_serial", NULL);
+    }
+    dev->debugfs = debugfs_create_dir(dev->mDev.name, uart_debugfs_root);
+    debugfs_create_u32("irq_count", 0444, dev->debugfs, &dev->stats.irq_count);
+    debugfs_create_u32("rx_irq_count", 0444, dev->debugfs, &dev->stats.rx_irq_count);
+    debugfs_create_u32("rx_bytes", 0444, dev->debugfs, &dev->stats.rx_bytes);
+    debugfs_create_u32("rx_dropped", 0444, dev->debugfs, &dev->stats.rx_dropped);
+    debugfs_create_u32("rx_overruns", 0444, dev->debugfs, &dev->stats.rx_overruns);
+    debugfs_create_u32("rx_high_watermark", 0444, dev->debugfs, &dev->stats.rx_high_watermark);
+    debugfs_create_u32("rx_framing_errors", 0444, dev->debugfs, &dev->dbg.rx_framing_errors);
+    debugfs_create_u32("rx_parity_errors", 0444, dev->debugfs, &dev->dbg.rx_parity_errors);
+    debugfs_create_u32("rx_breaks", 0444, dev->debugfs, &dev->dbg.rx_breaks);
+    debugfs_create_u32("rx_wakeups", 0444, dev->debugfs, &dev->dbg.rx_wakeups);
+    debugfs_create_u32("tx_bytes", 0444, dev->debugfs, &dev->dbg.tx_bytes);
+    debugfs_create_u32("tx_wakeups", 0444, dev->debugfs, &dev->dbg.tx_wakeups);
+    debugfs_create_u32("tx_stalls", 0444, dev->debugfs, &dev->dbg.tx_stalls);
+    debugfs_create_u64("tx_stall_ns", 0444, dev->debugfs, &dev->dbg.tx_stall_ns);
+    debugfs_create_file("rx_occupancy", 0444, dev->debugfs, dev, &rx_occupancy_fops);
+    debugfs_create_u32("rx_burst_merges", 0444, dev->debugfs, &dev->dbg.rx_burst_merges);
+    debugfs_create_u32("rx_poll_entries", 0444, dev->debugfs, &dev->dbg.rx_poll_entries);
+    debugfs_create_u64("rx_irq_mode_ns", 0444, dev->debugfs, &dev->dbg.rx_irq_mode_ns);
+    debugfs_create_u64("rx_poll_mode_ns", 0444, dev->debugfs, &dev->dbg.rx_poll_mode_ns);
+    //Tunables, take effect on the next interrupt or poll
+    debugfs_create_u32("poll_threshold", 0644, dev->debugfs, &dev->poll_threshold);
+    debugfs_create_u32("poll_interval_us", 0644, dev->debugfs, &dev->poll_interval_us);
+    debugfs_create_u32("poll_idle_limit", 0644, dev->debugfs, &dev->poll_idle_limit);
+}
+
+/*********************************************************/
+static int rx_occupancy_show(struct seq_file *m, void *v)
+{
+    struct uart_serial_dev *dev = m->private;
+    unsigned int size = dev->buf.size;
+    int i;
+    //One line per bucket: lowest and highest occupancy in bytes, then the number of bursts
+    for(i = 0; i < RX_OCCUPANCY_BUCKETS; i++)
+    {
+        unsigned int high = (i == RX_OCCUPANCY_BUCKETS - 1) ? size : (i + 1) * size / RX_OCCUPANCY_BUCKETS - 1;
+        seq_printf(m, "%6u-%-6u %u\n", i * size / RX_OCCUPANCY_BUCKETS, high, READ_ONCE(dev->dbg.rx_occupancy[i]));
     }
+    return 0;
+}
 
+/*********************************************************/
+static int uart_tty_probe(struct uart_serial_dev *dev, struct platform_device *pdev, struct resource *res)
+{
+    struct uart_port *port = &dev->port;
+    int error = 0;
+    port->dev = &pdev->dev;
+    port->type = PORT_OMAP;
+    port->iotype = UPIO_MEM;
+    port->mapbase = res ? res->start : 0;
+    port->membase = dev->regs;
+    port->irq = dev->irq;
+    port->uartclk = dev->uartclk;
+    port->fifosize = TX_FIFO_SIZE;
+    port->line = dev->this_uart_number;
+    port->ops = &uart_tty_ops;
     dev_set_drvdata(&pdev->dev, dev);
+    mutex_lock(&uart_devices_lock);
+    if(uart_tty_ports == 0)
+    {
+        error = uart_register_driver(&uart_tty_driver);
+        if(error)
+        {
+            pr_err("%s: uart_register_driver failed.", __func__);
+            goto out;
+        }
+    }
+    error = uart_add_one_port(&uart_tty_driver, port);
+    if(error)
+    {
+        pr_err("%s: uart_add_one_port failed.", __func__);
+        if(uart_tty_ports == 0)
+        {
+            uart_unregister_driver(&uart_tty_driver);
+        }
+        goto out;
+    }
+    error = uart_request_irq(dev, pdev, uart_tty_irq);
+    if(error)
+    {
+        uart_remove_one_port(&uart_tty_driver, port);
+        if(uart_tty_ports == 0)
+        {
+            uart_unregister_driver(&uart_tty_driver);
+        }
+        goto out;
+    }
+    uart_tty_ports++;
+    out:
+        mutex_unlock(&uart_devices_lock);
+        return error;
+}
+
+/*********************************************************/
+static irqreturn_t uart_tty_irq(int irq, void *d)
+{
+    struct uart_serial_dev *dev = d;
+    struct uart_port *port = &dev->port;
+    unsigned int lsr;
+    bool pushed = false;
+    spin_lock(&port->lock);
+    //As in irqHandler(): IIR acknowledges the THR interrupt, LSR tells what to service
+    if(reg_read(dev, UART_IIR) & UART_IIR_NO_INT)
+    {
+        spin_unlock(&port->lock);
+        return IRQ_NONE;
+    }
+    lsr = reg_read(dev, UART_LSR);
+    dev->stats.irq_count++;
+    if(lsr & UART_LSR_DR)
+    {
+        dev->stats.rx_irq_count++;
+        uart_tty_rx_chars(dev, lsr);
+        pushed = true;
+    }
+    if((lsr & UART_LSR_THRE) && (READ_ONCE(dev->ier) & UART_IER_THRI))
+    {
+        uart_tty_tx_chars(dev);
+    }
+    spin_unlock(&port->lock);
+    //Hands the flip buffer to the line discipline, outside the port lock
+    if(pushed)
+    {
+        tty_flip_buffer_push(&port->state->port);
+    }
+    return IRQ_HANDLED;
+}
+
+/*********************************************************/
+static void uart_tty_rx_chars(struct uart_serial_dev *dev, unsigned int lsr)
+{
+    //Called with the port lock held. lsr holds the flags of the character at the top of the FIFO
+    struct uart_port *port = &dev->port;
+    do
+    {
+        unsigned int ch = reg_read(dev, UART_RX);
+        unsigned int flag = TTY_NORMAL;
+        port->icount.rx++;
+        if(lsr & (UART_LSR_BI | UART_LSR_PE | UART_LSR_FE | UART_LSR_OE))
+        {
+            if(lsr & UART_LSR_BI)
+            {
+                //A break reads as a framing error as well
+                lsr &= ~(UART_LSR_FE | UART_LSR_PE);
+                port->icount.brk++;
+                uart_handle_break(port);
+            }
+            else if(lsr & UART_LSR_PE)
+            {
+                port->icount.parity++;
+            }
+            else if(lsr & UART_LSR_FE)
+            {
+                port->icount.frame++;
+            }
+            if(lsr & UART_LSR_OE)
+            {
+                port->icount.overrun++;
+            }
+            lsr &= port->read_status_mask;
+            if(lsr & UART_LSR_BI)
+            {
+                flag = TTY_BREAK;
+            }
+            else if(lsr & UART_LSR_PE)
+            {
+                flag = TTY_PARITY;
+            }
+            else if(lsr & UART_LSR_FE)
+            {
+                flag = TTY_FRAME;
+            }
+        }
+        uart_insert_char(port, lsr, UART_LSR_OE, ch, flag);
+        lsr = reg_read(dev, UART_LSR);
+    }
+    while(lsr & UART_LSR_DR);
+}
+
+/*********************************************************/
+static void uart_tty_tx_chars(struct uart_serial_dev *dev)
+{
+    //Called with the port lock held and LSR THRE set, the whole FIFO is free
+    struct uart_port *port = &dev->port;
+    struct circ_buf *xmit = &port->state->xmit;
+    unsigned int count = TX_FIFO_SIZE;
+    if(port->x_char)
+    {
+        reg_write(dev, port->x_char, UART_TX);
+        port->icount.tx++;
+        port->x_char = 0;
+        return;
+    }
+    if(uart_circ_empty(xmit) || uart_tx_stopped(port))
+    {
+        update_ier(dev, 0, UART_IER_THRI);
+        return;
+    }
+    do
+    {
+        reg_write(dev, xmit->buf[xmit->tail], UART_TX);
+        xmit->tail = (xmit->tail + 1) & (UART_XMIT_SIZE - 1);
+        port->icount.tx++;
+    }
+    while(--count > 0 && !uart_circ_empty(xmit));
+    if(uart_circ_chars_pending(xmit) < WAKEUP_CHARS)
+    {
+        uart_write_wakeup(port);
+    }
+    if(uart_circ_empty(xmit))
+    {
+        update_ier(dev, 0, UART_IER_THRI);
+    }
+}
+
+/*********************************************************/
+static unsigned int uart_tty_tx_empty(struct uart_port *port)
+{
+    struct uart_serial_dev *dev = container_of(port, struct uart_serial_dev, port);
+    return (reg_read(dev, UART_LSR) & UART_LSR_TEMT) ? TIOCSER_TEMT : 0;
+}
+
+/*********************************************************/
+static void uart_tty_set_mctrl(struct uart_port *port, unsigned int mctrl)
+{
+    //No modem control lines are wired on the Beaglebone UARTs
+}
+
+/*********************************************************/
+static unsigned int uart_tty_get_mctrl(struct uart_port *port)
+{
+    return TIOCM_CAR | TIOCM_DSR | TIOCM_CTS;
+}
+
+/*********************************************************/
+static void uart_tty_stop_tx(struct uart_port *port)
+{
+    struct uart_serial_dev *dev = container_of(port, struct uart_serial_dev, port);
+    update_ier(dev, 0, UART_IER_THRI);
+}
+
+/*********************************************************/
+static void uart_tty_start_tx(struct uart_port *port)
+{
+    struct uart_serial_dev *dev = container_of(port, struct uart_serial_dev, port);
+    //The THR empty interrupt fires right away and starts draining xmit
+    update_ier(dev, UART_IER_THRI, 0);
+}
+
+/*********************************************************/
+static void uart_tty_stop_rx(struct uart_port *port)
+{
+    struct uart_serial_dev *dev = container_of(port, struct uart_serial_dev, port);
+    update_ier(dev, 0, UART_IER_RDI);
+}
+
+/*********************************************************/
+static void uart_tty_break_ctl(struct uart_port *port, int break_state)
+{
+    struct uart_serial_dev *dev = container_of(port, struct uart_serial_dev, port);
+    unsigned long flags;
+    spin_lock_irqsave(&port->lock, flags);
+    if(break_state == -1)
+    {
+        dev->lcr |= UART_LCR_SBC;
+    }
+    else
+    {
+        dev->lcr &= ~UART_LCR_SBC;
+    }
+    reg_write(dev, dev->lcr, UART_LCR);
+    spin_unlock_irqrestore(&port->lock, flags);
+}
+
+/*********************************************************/
+static int uart_tty_startup(struct uart_port *port)
+{
+    struct uart_serial_dev *dev = container_of(port, struct uart_serial_dev, port);
+    unsigned long flags;
+    spin_lock_irqsave(&port->lock, flags);
+    program_line(dev, UART_FCR_CLEAR_RCVR | UART_FCR_CLEAR_XMIT);
+    update_ier(dev, UART_IER_RDI, 0);
+    spin_unlock_irqrestore(&port->lock, flags);
+    return 0;
+}
+
+/*********************************************************/
+static void uart_tty_shutdown(struct uart_port *port)
+{
+    struct uart_serial_dev *dev = container_of(port, struct uart_serial_dev, port);
+    unsigned long flags;
+    spin_lock_irqsave(&port->lock, flags);
+    update_ier(dev, 0, UART_IER_RDI | UART_IER_THRI);
+    dev->lcr &= ~UART_LCR_SBC;
+    reg_write(dev, dev->lcr, UART_LCR);
+    spin_unlock_irqrestore(&port->lock, flags);
+}
+
+/*********************************************************/
+static void uart_tty_set_termios(struct uart_port *port, struct ktermios *termios, struct ktermios *old)
+{
+    struct uart_serial_dev *dev = container_of(port, struct uart_serial_dev, port);
+    unsigned int lcr, baud;
+    unsigned long flags;
+    switch(termios->c_cflag & CSIZE)
+    {
+    case CS5:
+        lcr = UART_LCR_WLEN5;
+        break;
+    case CS6:
+        lcr = UART_LCR_WLEN6;
+        break;
+    case CS7:
+        lcr = UART_LCR_WLEN7;
+        break;
+    default:
+        lcr = UART_LCR_WLEN8;
+        break;
+    }
+    if(termios->c_cflag & CSTOPB)
+    {
+        lcr |= UART_LCR_STOP;
+    }
+    if(termios->c_cflag & PARENB)
+    {
+        lcr |= UART_LCR_PARITY;
+        if(!(termios->c_cflag & PARODD))
+        {
+            lcr |= UART_LCR_EPAR;
+        }
+    }
+    baud = uart_get_baud_rate(port, termios, old, 0, port->uartclk / 13);
+    spin_lock_irqsave(&port->lock, flags);
+    uart_update_timeout(port, termios->c_cflag, baud);
+    port->read_status_mask = UART_LSR_OE | UART_LSR_THRE | UART_LSR_DR;
+    if(termios->c_iflag & INPCK)
+    {
+        port->read_status_mask |= UART_LSR_FE | UART_LSR_PE;
+    }
+    if(termios->c_iflag & (BRKINT | PARMRK))
+    {
+        port->read_status_mask |= UART_LSR_BI;
+    }
+    port->ignore_status_mask = 0;
+    if(termios->c_iflag & IGNPAR)
+    {
+        port->ignore_status_mask |= UART_LSR_PE | UART_LSR_FE;
+    }
+    if(termios->c_iflag & IGNBRK)
+    {
+        port->ignore_status_mask |= UART_LSR_BI;
+    }
+    dev->divisor = line_divisor(port->uartclk, baud, &dev->mdr1);
+    dev->lcr = lcr;
+    dev->line.baud = baud;
+    dev->line.word_length = 5 + (lcr & 0x03);
+    dev->line.parity = !(lcr & UART_LCR_PARITY) ? UART_PARITY_NONE : (lcr & UART_LCR_EPAR) ? UART_PARITY_EVEN : UART_PARITY_ODD;
+    //The port lock keeps uart_tty_irq away from the registers while DLAB is set
+    program_line(dev, 0);
+    spin_unlock_irqrestore(&port->lock, flags);
+    if(tty_termios_baud_rate(termios))
+    {
+        tty_termios_encode_baud_rate(termios, baud, baud);
+    }
+}
 
-    //Enable RX interrupt
-    reg_write(dev, UART_IER_RDI, UART_IER);
+/*********************************************************/
+static const char *uart_tty_type(struct uart_port *port)
+{
+    return port->type == PORT_OMAP ? "uart_serial" : NULL;
+}
+
+/*********************************************************/
+static void uart_tty_release_port(struct uart_port *port)
+{
+    //The registers and IRQ are owned by the platform device
+}
+
+/*********************************************************/
+static int uart_tty_request_port(struct uart_port *port)
+{
+    return 0;
+}
+
+/*********************************************************/
+static void uart_tty_config_port(struct uart_port *port, int flags)
+{
+    if(flags & UART_CONFIG_TYPE)
+    {
+        port->type = PORT_OMAP;
+    }
+}
 
+/*********************************************************/
+static int uart_tty_verify_port(struct uart_port *port, struct serial_struct *ser)
+{
+    if(ser->type != PORT_UNKNOWN && ser->type != PORT_OMAP)
+    {
+        return -EINVAL;
+    }
     return 0;
 }
 
@@ -523,8 +2878,50 @@ static int uart_remove(struct platform_device *pdev)
     struct uart_serial_dev *dev;
     pm_runtime_disable(&pdev->dev);
     dev = dev_get_drvdata(&pdev->dev);
+    if(dev->tty)
+    {
+        uart_remove_one_port(&uart_tty_driver, &dev->port);
+        mutex_lock(&uart_devices_lock);
+        if(--uart_tty_ports == 0)
+        {
+            uart_unregister_driver(&uart_tty_driver);
+        }
+        mutex_unlock(&uart_devices_lock);
+        devm_free_irq(&pdev->dev, dev->irq, dev);
+        kref_put(&dev->ref, uart_dev_release);
+        return 0;
+    }
+    //A claiming LKM keeps its reference until uart_put(), its calls fail with -ENODEV meanwhile
+    mutex_lock(&uart_devices_lock);
+    list_del(&dev->node);
+    debugfs_remove_recursive(dev->debugfs);
+    if(list_empty(&uart_devices))
+    {
+        debugfs_remove_recursive(uart_debugfs_root);
+        uart_debugfs_root = NULL;
+    }
+    mutex_unlock(&uart_devices_lock);
+    misc_deregister(&dev->tapDev);
     misc_deregister(&dev->mDev);
-    mutex_destroy(&dev->write_protect);
+    //Files and mappings may still be around. Fail them from now on and wake whoever
+    //sleeps in them, then wait for the ones touching registers under the mutexes to leave
+    WRITE_ONCE(dev->dead, true);
+    wake_up_all(&dev->waitQ);
+    wake_up_all(&dev->tx_waitQ);
+    wake_up_all(&dev->tap_waitQ);
+    mutex_lock(&dev->write_protect);
+    mutex_unlock(&dev->write_protect);
+    mutex_lock(&dev->read_protect);
+    mutex_unlock(&dev->read_protect);
+    //Silence the UART, nothing may run on it once the registers are unmapped
+    disable_irq(dev->irq);
+    hrtimer_cancel(&dev->rx_poll_timer);
+    update_ier(dev, 0, UART_IER_RDI | UART_IER_THRI);
+    enable_irq(dev->irq);
+    devm_free_irq(&pdev->dev, dev->irq, dev);
+    cancel_work_sync(&dev->rx_work);
+    //The RX area and the struct go with the last file or mapping
+    kref_put(&dev->ref, uart_dev_release);
     return 0;
 }
 
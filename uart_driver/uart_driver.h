@@ -0,0 +1,117 @@
+/**
+* @file uart_driver.h
+* @brief Declares the uart_serial API exported to other LKMs
+*
+* Kernel-space only. Every call takes the handle returned by uart_get() or
+* uart_get_by_node(), so several UARTs can be driven by independent consumers.
+*
+* @version 1.0
+*
+*/
+
+#ifndef UART_DRIVER_H
+#define UART_DRIVER_H
+
+#include <linux/types.h>
+#include <linux/ktime.h>
+
+struct device_node;
+
+//Opaque handle of one uart_serial device
+struct uart_serial_dev;
+
+//Register access of a uart_serial device. offset is the 16550 register number
+    //(UART_RX, UART_LSR, ...), ctx is the one given in the platform data
+struct uart_reg_ops
+{
+    unsigned int (*read)(void *ctx, int offset);
+    void (*write)(void *ctx, unsigned int val, int offset);
+};
+
+//Platform data of a uart_serial device whose registers are not memory mapped.
+    //Register a platform device named UART_SERIAL_MODEL_NAME with this data and one IRQ resource
+struct uart_serial_platform_data
+{
+    const struct uart_reg_ops *ops;
+    void *ctx;
+    //Functional clock in Hz, the baud rate divisors are computed from it
+    unsigned int uartclk;
+};
+
+#define UART_SERIAL_MODEL_NAME "uart_serial_model"
+
+//RX handler, see uart_register_rx_handler()
+    //buf points straight into the RX buffer and is only valid during the call
+    //arrival is the CLOCK_MONOTONIC time the IRQ drained these bytes from the FIFO, 0 if unknown
+typedef void (*uart_rx_handler_t)(void *priv, const char *buf, size_t len, ktime_t arrival);
+
+//Claim a UART for exclusive in-kernel use
+    //name is "uart1", "uart4", "uart5" or the misc device name, e.g. "uart_serial-48022000"
+    //Returns ERR_PTR(-ENODEV) if there is no such UART, ERR_PTR(-EBUSY) if it is already claimed
+    //While claimed, read() and write() on its misc device return -EBUSY
+    //The handle stays valid until uart_put() even if the UART is removed meanwhile,
+    //every call on it then fails with -ENODEV
+struct uart_serial_dev *uart_get(const char *name);
+
+//Claim a UART for exclusive in-kernel use, given its device tree node (e.g. from a phandle)
+    //Same return values as uart_get(), ERR_PTR(-ENODEV) if np is NULL
+struct uart_serial_dev *uart_get_by_node(struct device_node *np);
+
+//Release a UART claimed with uart_get() or uart_get_by_node()
+void uart_put(struct uart_serial_dev *dev);
+
+//UART receive
+    //Blocks until data is available and copies up to size bytes
+ssize_t uart_receive(struct uart_serial_dev *dev, char *buf, size_t size);
+
+//UART receive
+    //Blocks up to msecs until data is available and copies up to size bytes, 0 on timeout
+ssize_t uart_receive_timeout(struct uart_serial_dev *dev, char *buf, size_t size, int msecs);
+
+//UART receive
+    //Blocks up to msecs (forever if negative) until delim is received and copies up to and including it
+ssize_t uart_receive_until(struct uart_serial_dev *dev, char *buf, size_t size, char delim, int msecs);
+
+//UART receive
+    //Blocks up to msecs (forever if negative) until min_bytes are available and copies up to size bytes
+ssize_t uart_receive_min(struct uart_serial_dev *dev, char *buf, size_t size, size_t min_bytes, int msecs);
+
+//UART receive
+    //Blocks up to msecs (forever if negative) until data is available and copies up to size bytes
+    //of a single RX burst. arrival is set to the ktime_get() time of the interrupt that drained them, 0 if unknown
+    //When more bursts wait than the driver keeps arrival times for, later ones count as part of an earlier one
+ssize_t uart_receive_timestamped(struct uart_serial_dev *dev, char *buf, size_t size, ktime_t *arrival, int msecs);
+
+//UART receive
+    //Blocks until size bytes are available or the ktime_get() based deadline passes, whichever
+    //comes first, and copies up to size bytes. The deadline covers the whole call, however the bytes
+    //trickle in. Returns 0 if nothing arrived by then, -EINTR if interrupted (call again with the
+    //same deadline to keep the budget)
+ssize_t uart_receive_deadline(struct uart_serial_dev *dev, char *buf, size_t size, ktime_t deadline);
+
+//UART send
+    //Queues the data for interrupt driven transmission, only blocks while the TX buffer is full
+ssize_t uart_send(struct uart_serial_dev *dev, const char *buf, size_t len);
+
+//Blocks up to msecs (forever if negative) until all queued data has left the transmitter
+int uart_send_flush(struct uart_serial_dev *dev, int msecs);
+
+//Change baud rate, word length and parity (UART_PARITY_* from uart_ioctl.h)
+int uart_set_line(struct uart_serial_dev *dev, unsigned int baud, unsigned int word_length, unsigned int parity);
+
+//Discard all received data that has not been read yet
+void uart_flush_buffer(struct uart_serial_dev *dev);
+
+//Push received data to handler instead of waiting for uart_receive*() calls
+    //handler runs from a high priority workqueue as soon as bytes arrive, with every byte
+    //received so far, in one call per burst drained by one interrupt (two if it wraps around
+    //the RX buffer), so all bytes of a call share its arrival time. It may sleep, but the
+    //RX buffer only makes room for new bytes once it returns
+    //While registered, uart_receive*() return -EBUSY. Returns -EBUSY if a handler is already registered
+int uart_register_rx_handler(struct uart_serial_dev *dev, uart_rx_handler_t handler, void *priv);
+
+//Stop pushing received data. Once this returns the handler is not running and will not be called again
+    //Also done by uart_put()
+void uart_unregister_rx_handler(struct uart_serial_dev *dev);
+
+#endif /* UART_DRIVER_H */
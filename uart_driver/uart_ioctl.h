@@ -0,0 +1,145 @@
+/**
+* @file uart_ioctl.h
+* @brief Declares ioctl commands of the uart_serial devices
+*
+* Used both for user-space and kernel-space
+*
+* @version 1.0
+*
+*/
+
+#ifndef UART_IOCTL_H
+#define UART_IOCTL_H
+
+#ifdef __KERNEL__
+#include <asm-generic/ioctl.h>
+#include <linux/types.h>
+#else
+#include <sys/ioctl.h>
+#include <stdint.h>
+#endif
+
+struct uart_irq_stats
+{
+    //Number of interrupts taken since the device was probed, RX and TX
+    uint32_t irq_count;
+    //Number of bytes received since the device was probed
+    uint32_t rx_bytes;
+    //Number of received bytes dropped because the RX buffer was full
+    uint32_t rx_dropped;
+    //Number of hardware FIFO overruns (LSR_OE), each loses at least one byte
+    uint32_t rx_overruns;
+    //Highest number of bytes ever waiting in the RX buffer
+    uint32_t rx_high_watermark;
+    //Size of the RX buffer in bytes
+    uint32_t rx_buffer_size;
+    //Number of interrupts that drained the RX FIFO, RX polls in polling mode are not counted
+    uint32_t rx_irq_count;
+};
+
+#define UART_PARITY_NONE    (0)
+#define UART_PARITY_ODD     (1)
+#define UART_PARITY_EVEN    (2)
+
+struct uart_line_config
+{
+    //Baud rate in bits per second
+    uint32_t baud;
+    //Number of data bits, from 5 to 8
+    uint32_t word_length;
+    //One of UART_PARITY_NONE, UART_PARITY_ODD or UART_PARITY_EVEN
+    uint32_t parity;
+};
+
+//First page of the area returned by mmap() on a uart_serial device, which must be mapped
+//MAP_SHARED from offset 0. The RX ring follows at data_offset, size bytes long (a power of two).
+//head and tail are free running: bytes are at data[index & (size - 1)] and head - tail
+//bytes are available. The driver only writes head, the consumer only writes tail.
+//Read head with acquire and write tail with release semantics, e.g. with
+//__atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) and __atomic_store_n(&hdr->tail, t, __ATOMIC_RELEASE).
+//poll() reports POLLIN while head != tail. While mapped, read() returns -EBUSY, and mmap()
+//returns -EBUSY while a read() is in progress, e.g. blocked waiting for data.
+struct uart_ring_header
+{
+    uint32_t head;
+    uint32_t tail;
+    uint32_t size;
+    uint32_t data_offset;
+};
+
+struct uart_timed_read
+{
+    //Receives the data. MUST be allocated before use
+    char *buf;
+    //In: size of buf. Out: number of bytes received
+    uint32_t len;
+    //Out: CLOCK_MONOTONIC time in ns at which the bytes were taken out of the RX FIFO, 0 if unknown
+    int64_t arrival_ns;
+};
+
+//Direction of a tap record
+#define UART_TAP_RX (0)
+#define UART_TAP_TX (1)
+
+//Reading the <uart>-tap device returns a stream of these records, each followed by len data bytes.
+//RX bytes are recorded when they are drained from the RX FIFO, bytes dropped because the RX
+//buffer was full are not. TX bytes are recorded when they are loaded into the TX FIFO.
+//Records that do not fit in the tap buffer are dropped whole, the stream stays in sync.
+struct uart_tap_record
+{
+    //CLOCK_MONOTONIC time in ns
+    int64_t time_ns;
+    uint16_t len;
+    //UART_TAP_RX or UART_TAP_TX
+    uint8_t dir;
+    uint8_t reserved;
+    uint32_t pad;
+};
+
+//Picked an arbitrary unused value, next to the one used by hm11_ioctl.h
+#define UART_IOC_MAGIC 0x19
+
+//Set the RX FIFO trigger level, in characters
+    //Valid values are 8, 16, 56 and 60. Anything else returns -EINVAL
+    //Bursts shorter than the trigger level are delivered by the RX timeout interrupt
+    //after 4 character times of line silence
+#define UART_SET_RX_TRIGGER _IOW(UART_IOC_MAGIC, 1, unsigned int)
+
+//Get the RX FIFO trigger level, in characters
+#define UART_GET_RX_TRIGGER _IOR(UART_IOC_MAGIC, 2, unsigned int)
+
+//Get the interrupt, received byte and RX buffer counters
+    //rx_irq_count / rx_bytes is the number of RX interrupts taken per received byte. irq_count
+    //also counts the TX (THR empty) interrupts, so it only gives that ratio while nothing is sent
+    //rx_high_watermark close to rx_buffer_size, or a non-zero rx_dropped, means the buffer is too small
+#define UART_GET_IRQ_STATS _IOR(UART_IOC_MAGIC, 3, struct uart_irq_stats)
+
+//Change baud rate, word length and parity
+    //Pending transmissions are completed first and both FIFOs are flushed
+    //If return value == -EINVAL, the baud rate can not be generated within 3% from the UART clock
+#define UART_SET_LINE _IOW(UART_IOC_MAGIC, 4, struct uart_line_config)
+
+//Get the current baud rate, word length and parity
+#define UART_GET_LINE _IOR(UART_IOC_MAGIC, 5, struct uart_line_config)
+
+//Enable (non-zero) or disable (0) raw mode
+    //In raw mode written data goes out unchanged, otherwise every \n is sent as \n\r
+#define UART_SET_RAW _IOW(UART_IOC_MAGIC, 6, unsigned int)
+
+//Get the raw mode, 1 if enabled
+#define UART_GET_RAW _IOR(UART_IOC_MAGIC, 7, unsigned int)
+
+//Read the bytes of one RX burst together with their arrival time
+    //Blocks like read() until data is available (-EAGAIN with O_NONBLOCK)
+    //Bytes drained by different interrupts are never returned by the same call, unless more
+    //bursts were waiting than the driver keeps arrival times for (rx_burst_merges in debugfs)
+    //The arrival time is taken once per interrupt, when the FIFO trigger level or the RX timeout
+    //fired, so the first bytes of a burst arrived up to trigger level + 4 character times earlier
+#define UART_READ_TIMED _IOWR(UART_IOC_MAGIC, 8, struct uart_timed_read)
+
+/**
+ * The maximum number of commands supported, used for bounds checking
+ */
+#define UART_IOC_MAXNR 8
+
+#endif /* UART_IOCTL_H */
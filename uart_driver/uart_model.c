@@ -0,0 +1,571 @@
+/*
+*  uart_model.c - Software model of the AM335x UART for the uart_serial driver
+*
+*  Registers a uart_serial_model platform device whose registers are emulated
+*  in memory, so the driver can be loaded and exercised without a Beaglebone,
+*  e.g. on a stock x86 kernel. Interrupts are delivered through an irq_sim
+*  domain (CONFIG_IRQ_SIM), so request_irq() and disable_irq() work unchanged.
+*
+*  The line is simulated at the programmed baud rate and frame format. What
+*  the driver transmits goes to a peer, which either echoes it (mode=loopback)
+*  or answers from a script (mode=script), e.g.
+*      insmod uart_model.ko mode=script script="AT=OK|AT+ADDR?=OK+ADDR:0017EA0923AE"
+*  With flood=1 the peer additionally sends a counting pattern at line rate.
+*  make test builds both modules and runs uart_model_test.sh, which checks the
+*  data and counters of a loopback and a flood run.
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or (at
+*  your option) any later version.
+*
+*  <https://www.gnu.org/licenses/gpl-3.0.html>
+*
+*/
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/platform_device.h>
+#include <linux/serial_reg.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/irq.h>
+#include <linux/irq_sim.h>
+#include <linux/interrupt.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#include "uart_driver.h"
+
+//Depth of both hardware FIFOs
+#define MODEL_FIFO_SIZE 64
+
+//Size of the peer buffers, powers of two
+#define PEER_OUT_SIZE 1024
+#define PEER_IN_SIZE 128
+
+//The line is advanced in steps of this many ns, several characters per step at high rates
+#define MODEL_TICK_NS (100 * NSEC_PER_USEC)
+
+//Most characters moved in one step, so a late timer does not dump a burst into the FIFOs
+#define MODEL_MAX_CHARS_PER_TICK (2 * MODEL_FIFO_SIZE)
+
+//Most request/reply pairs accepted in the script parameter
+#define MODEL_MAX_SCRIPT 16
+
+//Clock of the AM335x UARTs
+#define MODEL_UARTCLK 48000000
+
+static char *mode = "loopback";
+module_param(mode, charp, S_IRUGO);
+MODULE_PARM_DESC(mode, "Peer behaviour: loopback or script");
+
+static char *script = "";
+module_param(script, charp, S_IRUGO);
+MODULE_PARM_DESC(script, "Peer replies in script mode, as request=reply pairs separated by |");
+
+static bool flood;
+module_param(flood, bool, S_IRUGO);
+MODULE_PARM_DESC(flood, "Peer sends a counting pattern at line rate");
+
+struct script_entry
+{
+    const char *request;
+    size_t request_len;
+    const char *reply;
+};
+
+//Model state, every field is protected by lock
+struct uart_model
+{
+    spinlock_t lock;
+    //Registers
+    unsigned int ier;
+    unsigned int lcr;
+    unsigned int fcr;
+    unsigned int mcr;
+    unsigned int scr;
+    unsigned int omap_scr;
+    unsigned int mdr1;
+    unsigned int dll;
+    unsigned int dlm;
+    //Sticky until LSR is read
+    bool overrun;
+    //Free running FIFO indices, masked with MODEL_FIFO_SIZE - 1
+    unsigned char rx_fifo[MODEL_FIFO_SIZE];
+    unsigned int rx_head;
+    unsigned int rx_tail;
+    unsigned char tx_fifo[MODEL_FIFO_SIZE];
+    unsigned int tx_head;
+    unsigned int tx_tail;
+    //Time since the last character entered the RX FIFO, for the RX timeout interrupt
+    u64 rx_idle_ns;
+    //Line time not yet spent on a whole character
+    u64 credit_ns;
+    ktime_t last;
+    //Bytes the peer will send
+    unsigned char peer_out[PEER_OUT_SIZE];
+    unsigned int peer_out_head;
+    unsigned int peer_out_tail;
+    //Bytes the peer received since its last scripted reply
+    char peer_in[PEER_IN_SIZE];
+    unsigned int peer_in_len;
+    unsigned char flood_seq;
+    bool loopback;
+    struct script_entry script[MODEL_MAX_SCRIPT];
+    unsigned int script_len;
+    char *script_buf;
+    struct hrtimer timer;
+    struct irq_domain *domain;
+    unsigned int irq;
+    struct platform_device *pdev;
+};
+
+//Register read and write, the uart_reg_ops of the model
+static unsigned int model_reg_read(void *ctx, int offset);
+static void model_reg_write(void *ctx, unsigned int val, int offset);
+
+//Timer routine moving characters on the line
+static enum hrtimer_restart model_tick(struct hrtimer *timer);
+
+//Utility method to raise the interrupt if any enabled condition holds
+static void model_update_irq(struct uart_model *m);
+
+//Utility method to get the duration of one character in ns, 0 while the baud clock is stopped
+static u64 model_char_ns(struct uart_model *m);
+
+//Utility method to get the RX FIFO trigger level from FCR
+static unsigned int model_rx_trigger(struct uart_model *m);
+
+//Utility method to hand a character the driver transmitted to the peer
+static void peer_receive(struct uart_model *m, unsigned char c);
+
+//Utility method to queue bytes the peer will send
+static void peer_send(struct uart_model *m, const char *buf, size_t len);
+
+//Utility method to parse the script parameter
+static int model_parse_script(struct uart_model *m);
+
+static const struct uart_reg_ops model_reg_ops = {
+    .read = model_reg_read,
+    .write = model_reg_write,
+};
+
+static struct uart_model *model;
+
+/*********************************************************/
+static unsigned int model_reg_read(void *ctx, int offset)
+{
+    struct uart_model *m = ctx;
+    unsigned long flags;
+    unsigned int val = 0;
+    spin_lock_irqsave(&m->lock, flags);
+    //Offsets 0 and 1 are the divisor latch while DLAB is set
+    if((m->lcr & UART_LCR_DLAB) && (offset == UART_DLL || offset == UART_DLM))
+    {
+        val = (offset == UART_DLL) ? m->dll : m->dlm;
+        goto out;
+    }
+    switch(offset)
+    {
+    case UART_RX:
+        if(m->rx_head != m->rx_tail)
+        {
+            val = m->rx_fifo[m->rx_tail++ & (MODEL_FIFO_SIZE - 1)];
+        }
+        break;
+    case UART_IER:
+        val = m->ier;
+        break;
+    case UART_IIR:
+        val = UART_IIR_NO_INT;
+        if((m->ier & UART_IER_RDI) && m->rx_head != m->rx_tail)
+        {
+            val = UART_IIR_RDI;
+        }
+        else if((m->ier & UART_IER_THRI) && m->tx_head == m->tx_tail)
+        {
+            val = UART_IIR_THRI;
+        }
+        break;
+    case UART_LCR:
+        val = m->lcr;
+        break;
+    case UART_MCR:
+        val = m->mcr;
+        break;
+    case UART_LSR:
+        if(m->rx_head != m->rx_tail)
+        {
+            val |= UART_LSR_DR;
+        }
+        if(m->overrun)
+        {
+            val |= UART_LSR_OE;
+            m->overrun = false;
+        }
+        //No shift register is modelled, a character leaves the FIFO when it is on the wire
+        if(m->tx_head == m->tx_tail)
+        {
+            val |= UART_LSR_THRE | UART_LSR_TEMT;
+        }
+        break;
+    case UART_SCR:
+        val = m->scr;
+        break;
+    case UART_OMAP_SCR:
+        val = m->omap_scr;
+        break;
+    case UART_OMAP_MDR1:
+        val = m->mdr1;
+        break;
+    default:
+        break;
+    }
+    out:
+        spin_unlock_irqrestore(&m->lock, flags);
+        return val;
+}
+
+/*********************************************************/
+static void model_reg_write(void *ctx, unsigned int val, int offset)
+{
+    struct uart_model *m = ctx;
+    unsigned long flags;
+    spin_lock_irqsave(&m->lock, flags);
+    if((m->lcr & UART_LCR_DLAB) && (offset == UART_DLL || offset == UART_DLM))
+    {
+        if(offset == UART_DLL)
+        {
+            m->dll = val & 0xff;
+        }
+        else
+        {
+            m->dlm = val & 0xff;
+        }
+        goto out;
+    }
+    switch(offset)
+    {
+    case UART_TX:
+        //Like the hardware, a write to a full FIFO is lost
+        if(m->tx_head - m->tx_tail < MODEL_FIFO_SIZE)
+        {
+            m->tx_fifo[m->tx_head++ & (MODEL_FIFO_SIZE - 1)] = val;
+        }
+        break;
+    case UART_IER:
+        m->ier = val & 0x0f;
+        //Enabling THRI with an empty FIFO interrupts right away
+        model_update_irq(m);
+        break;
+    case UART_FCR:
+        m->fcr = val & ~(UART_FCR_CLEAR_RCVR | UART_FCR_CLEAR_XMIT);
+        if(val & UART_FCR_CLEAR_RCVR)
+        {
+            m->rx_tail = m->rx_head;
+        }
+        if(val & UART_FCR_CLEAR_XMIT)
+        {
+            m->tx_tail = m->tx_head;
+        }
+        break;
+    case UART_LCR:
+        m->lcr = val & 0xff;
+        break;
+    case UART_MCR:
+        m->mcr = val;
+        break;
+    case UART_SCR:
+        m->scr = val;
+        break;
+    case UART_OMAP_SCR:
+        m->omap_scr = val;
+        break;
+    case UART_OMAP_MDR1:
+        m->mdr1 = val;
+        break;
+    default:
+        break;
+    }
+    out:
+        spin_unlock_irqrestore(&m->lock, flags);
+}
+
+/*********************************************************/
+static u64 model_char_ns(struct uart_model *m)
+{
+    unsigned int divisor = (m->dlm << 8) | m->dll;
+    unsigned int oversampling = (m->mdr1 == UART_OMAP_MDR1_13X_MODE) ? 13 : 16;
+    //Start bit, 5 to 8 data bits, optional parity bit, 1 or 2 stop bits
+    unsigned int bits = 1 + 5 + (m->lcr & 0x03) + ((m->lcr & UART_LCR_PARITY) ? 1 : 0) + ((m->lcr & UART_LCR_STOP) ? 2 : 1);
+    //The baud clock is stopped while the divisor is 0 or the UART is disabled
+    if(divisor == 0 || (m->mdr1 != UART_OMAP_MDR1_16X_MODE && m->mdr1 != UART_OMAP_MDR1_13X_MODE))
+    {
+        return 0;
+    }
+    return div_u64((u64)divisor * oversampling * bits * NSEC_PER_SEC, MODEL_UARTCLK);
+}
+
+/*********************************************************/
+static unsigned int model_rx_trigger(struct uart_model *m)
+{
+    switch(m->fcr & UART_FCR_TRIGGER_MASK)
+    {
+    case UART_FCR_R_TRIG_01:
+        return 16;
+    case UART_FCR_R_TRIG_10:
+        return 56;
+    case UART_FCR_R_TRIG_11:
+        return 60;
+    default:
+        return 8;
+    }
+}
+
+/*********************************************************/
+static void model_update_irq(struct uart_model *m)
+{
+    //Called with lock held. irq_sim interrupts are edge like, so this is called on every
+    //tick as well: a condition the handler left standing is raised again one tick later
+    unsigned int rx_count = m->rx_head - m->rx_tail;
+    u64 char_ns = model_char_ns(m);
+    bool pending = false;
+    if((m->ier & UART_IER_RDI) && rx_count)
+    {
+        //Trigger level reached, or the RX timeout of 4 character times of silence
+        pending = rx_count >= model_rx_trigger(m) || m->rx_idle_ns >= 4 * char_ns;
+    }
+    //Only the THR interrupt of SCR TX_EMPTY_CTL_IT is modelled (FIFO empty), as programmed
+    //by uart_serial, not the one at the TX trigger level
+    if((m->ier & UART_IER_THRI) && m->tx_head == m->tx_tail)
+    {
+        pending = true;
+    }
+    if(pending)
+    {
+        irq_set_irqchip_state(m->irq, IRQCHIP_STATE_PENDING, true);
+    }
+}
+
+/*********************************************************/
+static enum hrtimer_restart model_tick(struct hrtimer *timer)
+{
+    struct uart_model *m = container_of(timer, struct uart_model, timer);
+    ktime_t now = ktime_get();
+    unsigned long flags;
+    unsigned int chars = 0;
+    u64 char_ns;
+    spin_lock_irqsave(&m->lock, flags);
+    char_ns = model_char_ns(m);
+    if(char_ns)
+    {
+        m->credit_ns += ktime_to_ns(ktime_sub(now, m->last));
+        m->rx_idle_ns += ktime_to_ns(ktime_sub(now, m->last));
+        //Full duplex: every character time one character goes out and one comes in
+        while(m->credit_ns >= char_ns && chars < MODEL_MAX_CHARS_PER_TICK)
+        {
+            if(m->tx_head != m->tx_tail)
+            {
+                peer_receive(m, m->tx_fifo[m->tx_tail++ & (MODEL_FIFO_SIZE - 1)]);
+            }
+            if(m->peer_out_head == m->peer_out_tail && flood)
+            {
+                m->peer_out[m->peer_out_head++ & (PEER_OUT_SIZE - 1)] = m->flood_seq++;
+            }
+            if(m->peer_out_head != m->peer_out_tail)
+            {
+                unsigned char c = m->peer_out[m->peer_out_tail++ & (PEER_OUT_SIZE - 1)];
+                if(m->rx_head - m->rx_tail < MODEL_FIFO_SIZE)
+                {
+                    m->rx_fifo[m->rx_head++ & (MODEL_FIFO_SIZE - 1)] = c;
+                }
+                else
+                {
+                    m->overrun = true;
+                }
+                m->rx_idle_ns = 0;
+            }
+            m->credit_ns -= char_ns;
+            chars++;
+        }
+        //Time the timer ran late is lost rather than replayed as a burst
+        m->credit_ns = min(m->credit_ns, char_ns);
+    }
+    m->last = now;
+    model_update_irq(m);
+    spin_unlock_irqrestore(&m->lock, flags);
+    hrtimer_forward_now(timer, ns_to_ktime(MODEL_TICK_NS));
+    return HRTIMER_RESTART;
+}
+
+/*********************************************************/
+static void peer_receive(struct uart_model *m, unsigned char c)
+{
+    unsigned int i;
+    if(m->loopback)
+    {
+        peer_send(m, (const char *)&c, 1);
+        return;
+    }
+    //Requests are not terminated, so reply as soon as the received bytes end with one
+    if(m->peer_in_len == PEER_IN_SIZE)
+    {
+        memmove(m->peer_in, m->peer_in + 1, PEER_IN_SIZE - 1);
+        m->peer_in_len--;
+    }
+    m->peer_in[m->peer_in_len++] = c;
+    for(i = 0; i < m->script_len; i++)
+    {
+        struct script_entry *e = &m->script[i];
+        if(m->peer_in_len >= e->request_len && !memcmp(m->peer_in + m->peer_in_len - e->request_len, e->request, e->request_len))
+        {
+            peer_send(m, e->reply, strlen(e->reply));
+            m->peer_in_len = 0;
+            break;
+        }
+    }
+}
+
+/*********************************************************/
+static void peer_send(struct uart_model *m, const char *buf, size_t len)
+{
+    size_t i;
+    for(i = 0; i < len && m->peer_out_head - m->peer_out_tail < PEER_OUT_SIZE; i++)
+    {
+        m->peer_out[m->peer_out_head++ & (PEER_OUT_SIZE - 1)] = buf[i];
+    }
+}
+
+/*********************************************************/
+static int model_parse_script(struct uart_model *m)
+{
+    char *cursor, *entry;
+    m->script_buf = kstrdup(script, GFP_KERNEL);
+    if(!m->script_buf)
+    {
+        return -ENOMEM;
+    }
+    cursor = m->script_buf;
+    while((entry = strsep(&cursor, "|")) != NULL)
+    {
+        char *request = strsep(&entry, "=");
+        if(!entry || !*request)
+        {
+            pr_err("%s: malformed script entry \"%s\"\n", __func__, request);
+            return -EINVAL;
+        }
+        if(m->script_len == MODEL_MAX_SCRIPT)
+        {
+            pr_err("%s: more than %d script entries\n", __func__, MODEL_MAX_SCRIPT);
+            return -EINVAL;
+        }
+        m->script[m->script_len].request = request;
+        m->script[m->script_len].request_len = strlen(request);
+        m->script[m->script_len].reply = entry;
+        m->script_len++;
+    }
+    return 0;
+}
+
+/*********************************************************/
+static int __init uart_model_init(void)
+{
+    struct uart_serial_platform_data pdata;
+    struct platform_device_info info;
+    struct resource res;
+    int ret;
+    model = kzalloc(sizeof(*model), GFP_KERNEL);
+    if(!model)
+    {
+        return -ENOMEM;
+    }
+    spin_lock_init(&model->lock);
+    if(!strcmp(mode, "loopback"))
+    {
+        model->loopback = true;
+    }
+    else if(strcmp(mode, "script"))
+    {
+        pr_err("%s: unknown mode %s\n", __func__, mode);
+        ret = -EINVAL;
+        goto free_model;
+    }
+    else if(*script)
+    {
+        ret = model_parse_script(model);
+        if(ret)
+        {
+            goto free_model;
+        }
+    }
+    //One simulated interrupt line, the driver requests it like any other
+    model->domain = irq_domain_create_sim(NULL, 1);
+    if(IS_ERR(model->domain))
+    {
+        ret = PTR_ERR(model->domain);
+        goto free_model;
+    }
+    model->irq = irq_create_mapping(model->domain, 0);
+    if(!model->irq)
+    {
+        ret = -ENXIO;
+        goto remove_domain;
+    }
+    model->last = ktime_get();
+    hrtimer_init(&model->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    model->timer.function = model_tick;
+    hrtimer_start(&model->timer, ns_to_ktime(MODEL_TICK_NS), HRTIMER_MODE_REL);
+
+    pdata.ops = &model_reg_ops;
+    pdata.ctx = model;
+    pdata.uartclk = MODEL_UARTCLK;
+    memset(&res, 0, sizeof(res));
+    res.start = model->irq;
+    res.end = model->irq;
+    res.flags = IORESOURCE_IRQ;
+    memset(&info, 0, sizeof(info));
+    info.name = UART_SERIAL_MODEL_NAME;
+    info.id = PLATFORM_DEVID_NONE;
+    info.res = &res;
+    info.num_res = 1;
+    info.data = &pdata;
+    info.size_data = sizeof(pdata);
+    model->pdev = platform_device_register_full(&info);
+    if(IS_ERR(model->pdev))
+    {
+        ret = PTR_ERR(model->pdev);
+        goto cancel_timer;
+    }
+    return 0;
+
+    cancel_timer:
+        hrtimer_cancel(&model->timer);
+        irq_dispose_mapping(model->irq);
+    remove_domain:
+        irq_domain_remove_sim(model->domain);
+    free_model:
+        kfree(model->script_buf);
+        kfree(model);
+        return ret;
+}
+
+/*********************************************************/
+static void __exit uart_model_exit(void)
+{
+    //Removes the uart_serial device first, it stops touching the registers
+    platform_device_unregister(model->pdev);
+    hrtimer_cancel(&model->timer);
+    irq_dispose_mapping(model->irq);
+    irq_domain_remove_sim(model->domain);
+    kfree(model->script_buf);
+    kfree(model);
+}
+
+module_init(uart_model_init);
+module_exit(uart_model_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Software model of the AM335x UART for the uart_serial driver");
@@ -0,0 +1,315 @@
+/*
+*  uart_model_test.c - Tests of the uart_serial driver against the UART model
+*
+*  Run by uart_model_test.sh with uart_model.ko loaded in the matching mode:
+*      uart_model_test loopback [device]   mode=loopback: what is written must come back unchanged
+*      uart_model_test flood [device]      flood=1: the counting pattern must arrive without gaps
+*  Besides the data, the UART_GET_IRQ_STATS counters must account for every byte, with
+*  nothing dropped or overrun. Exits with 0 if every check passed.
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or (at
+*  your option) any later version.
+*
+*  <https://www.gnu.org/licenses/gpl-3.0.html>
+*
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include "uart_ioctl.h"
+
+#define DEFAULT_DEVICE          ("/dev/uart_serial_model")
+//Bytes sent per loopback run, several times the RX and TX buffers
+#define LOOPBACK_LEN            (4096)
+//Bytes per write(), small enough that the echo of what is queued always fits in the RX buffer
+#define LOOPBACK_CHUNK          (64)
+//Bytes checked in flood mode, about 1.5 s at 115200 baud
+#define FLOOD_LEN               (16384)
+//Longest silence tolerated while data is expected
+#define RX_TIMEOUT_MS           (2000)
+
+//Baud rates the loopback test is run at. At the model's 48MHz clock 115200 and 230400
+//use the 16x divisor, 460800 needs MDR1 13x mode (16x would be 7% off)
+static const unsigned int loopback_bauds[] = {115200, 230400, 460800};
+
+static int failures;
+
+static void check(int ok, const char *what);
+static int get_stats(int fd, struct uart_irq_stats *stats);
+static int set_baud(int fd, unsigned int baud);
+static ssize_t read_full(int fd, unsigned char *buf, size_t len);
+static int drain(int fd);
+static int test_loopback(int fd, unsigned int baud);
+static int test_flood(int fd);
+
+static void check(int ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if(!ok)
+    {
+        failures++;
+    }
+}
+
+static int get_stats(int fd, struct uart_irq_stats *stats)
+{
+    if(ioctl(fd, UART_GET_IRQ_STATS, stats) == -1)
+    {
+        perror("UART_GET_IRQ_STATS");
+        return -1;
+    }
+    return 0;
+}
+
+static int set_baud(int fd, unsigned int baud)
+{
+    struct uart_line_config line = {baud, 8, UART_PARITY_NONE};
+    if(ioctl(fd, UART_SET_LINE, &line) == -1)
+    {
+        perror("UART_SET_LINE");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+*   Reads exactly len bytes, unless the line stays silent for RX_TIMEOUT_MS.
+*   Returns the number of bytes read, -1 on error.
+*/
+static ssize_t read_full(int fd, unsigned char *buf, size_t len)
+{
+    size_t done = 0;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while(done < len)
+    {
+        ssize_t ret;
+        int ready = poll(&pfd, 1, RX_TIMEOUT_MS);
+        if(ready == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("poll");
+            return -1;
+        }
+        if(ready == 0)
+        {
+            break;
+        }
+        ret = read(fd, buf + done, len - done);
+        if(ret == -1)
+        {
+            if(errno == EINTR || errno == EAGAIN)
+                continue;
+            perror("read");
+            return -1;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+/*
+*   Discards whatever is buffered. Returns -1 on error.
+*/
+static int drain(int fd)
+{
+    unsigned char buf[256];
+    while(1)
+    {
+        ssize_t ret = read(fd, buf, sizeof(buf));
+        if(ret == -1 && errno == EAGAIN)
+        {
+            return 0;
+        }
+        if(ret == -1 && errno != EINTR)
+        {
+            perror("read");
+            return -1;
+        }
+    }
+}
+
+/*
+*   Writes a pattern and reads it back through the model's loopback peer.
+*/
+static int test_loopback(int fd, unsigned int baud)
+{
+    static unsigned char tx[LOOPBACK_LEN];
+    static unsigned char rx[LOOPBACK_LEN];
+    struct uart_irq_stats before, after;
+    char what[96];
+    size_t written = 0;
+    ssize_t received = 0;
+    int configured;
+    size_t i;
+    //A rate the driver refuses is a failed check, the other rates are still tried
+    snprintf(what, sizeof(what), "loopback %u baud: line configured", baud);
+    configured = set_baud(fd, baud) == 0;
+    check(configured, what);
+    if(!configured)
+    {
+        return 0;
+    }
+    if(drain(fd) || get_stats(fd, &before))
+    {
+        return -1;
+    }
+    for(i = 0; i < LOOPBACK_LEN; i++)
+    {
+        tx[i] = i * 7;
+    }
+    //The pattern is larger than both buffers, so the echo has to be read while writing
+    while(received < LOOPBACK_LEN)
+    {
+        struct pollfd pfd = {fd, POLLIN | (written < LOOPBACK_LEN ? POLLOUT : 0), 0};
+        ssize_t ret;
+        int ready = poll(&pfd, 1, RX_TIMEOUT_MS);
+        if(ready == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(ready <= 0)
+        {
+            break;
+        }
+        if(pfd.revents & POLLIN)
+        {
+            ret = read(fd, rx + received, LOOPBACK_LEN - received);
+            if(ret == -1 && errno != EAGAIN && errno != EINTR)
+            {
+                perror("read");
+                return -1;
+            }
+            received += ret > 0 ? ret : 0;
+        }
+        if(pfd.revents & POLLOUT)
+        {
+            ret = write(fd, tx + written, LOOPBACK_LEN - written > LOOPBACK_CHUNK ? LOOPBACK_CHUNK : LOOPBACK_LEN - written);
+            if(ret == -1 && errno != EAGAIN && errno != EINTR)
+            {
+                perror("write");
+                return -1;
+            }
+            written += ret > 0 ? ret : 0;
+        }
+    }
+    if(get_stats(fd, &after))
+    {
+        return -1;
+    }
+    snprintf(what, sizeof(what), "loopback %u baud: %zd of %d bytes back", baud, received, LOOPBACK_LEN);
+    check(received == LOOPBACK_LEN, what);
+    snprintf(what, sizeof(what), "loopback %u baud: data unchanged", baud);
+    check(received == LOOPBACK_LEN && memcmp(tx, rx, LOOPBACK_LEN) == 0, what);
+    snprintf(what, sizeof(what), "loopback %u baud: rx_bytes counts %u bytes", baud, after.rx_bytes - before.rx_bytes);
+    check(after.rx_bytes - before.rx_bytes == LOOPBACK_LEN, what);
+    snprintf(what, sizeof(what), "loopback %u baud: %u dropped, %u overruns", baud, after.rx_dropped - before.rx_dropped,
+        after.rx_overruns - before.rx_overruns);
+    check(after.rx_dropped == before.rx_dropped && after.rx_overruns == before.rx_overruns, what);
+    snprintf(what, sizeof(what), "loopback %u baud: %u RX interrupts of %u", baud, after.rx_irq_count - before.rx_irq_count,
+        after.irq_count - before.irq_count);
+    check(after.rx_irq_count > before.rx_irq_count && after.irq_count - before.irq_count >= after.rx_irq_count - before.rx_irq_count, what);
+    return 0;
+}
+
+/*
+*   Reads the model's counting pattern and checks that no byte went missing.
+*/
+static int test_flood(int fd)
+{
+    static unsigned char rx[FLOOD_LEN];
+    struct uart_irq_stats before, after;
+    char what[96];
+    ssize_t received;
+    size_t gaps = 0;
+    size_t i;
+    if(set_baud(fd, 115200))
+    {
+        return -1;
+    }
+    //Start from a known point, whatever was buffered before is older than the counters
+    if(drain(fd) || get_stats(fd, &before))
+    {
+        return -1;
+    }
+    received = read_full(fd, rx, FLOOD_LEN);
+    if(received < 0 || get_stats(fd, &after))
+    {
+        return -1;
+    }
+    for(i = 1; i < (size_t)received; i++)
+    {
+        if(rx[i] != (unsigned char)(rx[i - 1] + 1))
+        {
+            gaps++;
+        }
+    }
+    snprintf(what, sizeof(what), "flood: %zd of %d bytes", received, FLOOD_LEN);
+    check(received == FLOOD_LEN, what);
+    snprintf(what, sizeof(what), "flood: %zu gaps in the counting pattern", gaps);
+    check(received > 0 && gaps == 0, what);
+    snprintf(what, sizeof(what), "flood: rx_bytes counts %u bytes", after.rx_bytes - before.rx_bytes);
+    check(after.rx_bytes - before.rx_bytes >= (uint32_t)received, what);
+    snprintf(what, sizeof(what), "flood: %u dropped, %u overruns", after.rx_dropped - before.rx_dropped,
+        after.rx_overruns - before.rx_overruns);
+    check(after.rx_dropped == before.rx_dropped && after.rx_overruns == before.rx_overruns, what);
+    snprintf(what, sizeof(what), "flood: high watermark %u of %u", after.rx_high_watermark, after.rx_buffer_size);
+    check(after.rx_high_watermark <= after.rx_buffer_size, what);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = argc > 2 ? argv[2] : DEFAULT_DEVICE;
+    unsigned int raw = 1;
+    int ret = -1;
+    int fd;
+    size_t i;
+    if(argc < 2 || (strcmp(argv[1], "loopback") && strcmp(argv[1], "flood")))
+    {
+        fprintf(stderr, "Usage: %s loopback|flood [device]\n", argv[0]);
+        return 2;
+    }
+    fd = open(device, O_RDWR | O_NONBLOCK);
+    if(fd == -1)
+    {
+        perror(device);
+        return 1;
+    }
+    //Compare bytes, not lines: no \n to \n\r expansion
+    if(ioctl(fd, UART_SET_RAW, &raw) == -1)
+    {
+        perror("UART_SET_RAW");
+        goto out;
+    }
+    if(!strcmp(argv[1], "loopback"))
+    {
+        for(i = 0; i < sizeof(loopback_bauds) / sizeof(loopback_bauds[0]); i++)
+        {
+            ret = test_loopback(fd, loopback_bauds[i]);
+            if(ret)
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        ret = test_flood(fd);
+    }
+    out:
+        close(fd);
+        if(ret)
+        {
+            printf("FAIL: %s test could not run\n", argv[1]);
+            return 1;
+        }
+        printf("%s: %d failed checks\n", argv[1], failures);
+        return failures ? 1 : 0;
+}
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Runs uart_model_test against the UART model: once in loopback mode and once flooded
+# with the counting pattern. Needs root, the modules built with make UART_MODEL=y and
+# a kernel with CONFIG_IRQ_SIM. Exits with 0 if every test passed.
+cd `dirname $0`
+device=/dev/uart_serial_model
+status=0
+
+unload()
+{
+    rmmod uart_model 2>/dev/null
+    rmmod uart_driver 2>/dev/null
+}
+
+# run <test> <uart_model parameters>
+run()
+{
+    test=$1
+    shift
+    insmod ./uart_driver.ko || return 1
+    if ! insmod ./uart_model.ko "$@"; then
+        unload
+        return 1
+    fi
+    # The device node shows up asynchronously
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        [ -e $device ] && break
+        sleep 0.2
+    done
+    ./uart_model_test $test $device
+    result=$?
+    unload
+    return $result
+}
+
+trap unload EXIT
+run loopback mode=loopback || status=1
+run flood mode=script flood=1 || status=1
+if [ $status -eq 0 ]; then
+    echo "All uart_model tests passed"
+else
+    echo "Some uart_model tests failed"
+fi
+exit $status
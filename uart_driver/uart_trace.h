@@ -0,0 +1,130 @@
+/**
+* @file uart_trace.h
+* @brief Declares the tracepoints of the uart_serial driver
+*
+* Kernel-space only. The events show up under /sys/kernel/tracing/events/uart_serial
+* and cost a single patched-out branch each while disabled.
+*
+* @version 1.0
+*
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM uart_serial
+
+#if !defined(UART_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define UART_TRACE_H
+
+#include <linux/tracepoint.h>
+
+//Interrupt handler entry, with the LSR value that decides what gets serviced
+TRACE_EVENT(uart_irq_entry,
+    TP_PROTO(const char *name, unsigned int lsr),
+    TP_ARGS(name, lsr),
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(unsigned int, lsr)
+    ),
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->lsr = lsr;
+    ),
+    TP_printk("%s lsr=0x%02x", __get_str(name), __entry->lsr)
+);
+
+//Interrupt handler exit, with the bytes moved from the RX FIFO and to the TX FIFO
+TRACE_EVENT(uart_irq_exit,
+    TP_PROTO(const char *name, unsigned int rx_drained, unsigned int tx_filled),
+    TP_ARGS(name, rx_drained, tx_filled),
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(unsigned int, rx_drained)
+        __field(unsigned int, tx_filled)
+    ),
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->rx_drained = rx_drained;
+        __entry->tx_filled = tx_filled;
+    ),
+    TP_printk("%s rx_drained=%u tx_filled=%u", __get_str(name), __entry->rx_drained, __entry->tx_filled)
+);
+
+//Bytes added to or removed from a ring, and the number of bytes left in it afterwards
+DECLARE_EVENT_CLASS(uart_ring,
+    TP_PROTO(const char *name, unsigned int count, unsigned int occupancy),
+    TP_ARGS(name, count, occupancy),
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(unsigned int, count)
+        __field(unsigned int, occupancy)
+    ),
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->count = count;
+        __entry->occupancy = occupancy;
+    ),
+    TP_printk("%s count=%u occupancy=%u", __get_str(name), __entry->count, __entry->occupancy)
+);
+
+//RX FIFO drained into the RX ring, from the interrupt handler
+DEFINE_EVENT(uart_ring, uart_rx_enqueue,
+    TP_PROTO(const char *name, unsigned int count, unsigned int occupancy),
+    TP_ARGS(name, count, occupancy)
+);
+
+//RX ring read by read(), an ioctl or an in-kernel consumer
+DEFINE_EVENT(uart_ring, uart_rx_dequeue,
+    TP_PROTO(const char *name, unsigned int count, unsigned int occupancy),
+    TP_ARGS(name, count, occupancy)
+);
+
+//TX ring filled by write() or uart_send()
+DEFINE_EVENT(uart_ring, uart_tx_enqueue,
+    TP_PROTO(const char *name, unsigned int count, unsigned int occupancy),
+    TP_ARGS(name, count, occupancy)
+);
+
+//TX ring moved to the TX FIFO, from the interrupt handler
+DEFINE_EVENT(uart_ring, uart_tx_dequeue,
+    TP_PROTO(const char *name, unsigned int count, unsigned int occupancy),
+    TP_ARGS(name, count, occupancy)
+);
+
+//The interrupt handler woke up the RX (tx == 0) or TX (tx == 1) waiters
+TRACE_EVENT(uart_wakeup,
+    TP_PROTO(const char *name, bool tx),
+    TP_ARGS(name, tx),
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(bool, tx)
+    ),
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->tx = tx;
+    ),
+    TP_printk("%s %s", __get_str(name), __entry->tx ? "tx" : "rx")
+);
+
+//The TX ring is empty and the THR empty interrupt has been disabled.
+//The last bytes are still in the TX FIFO, up to 64 character times from the wire
+TRACE_EVENT(uart_tx_done,
+    TP_PROTO(const char *name),
+    TP_ARGS(name),
+    TP_STRUCT__entry(
+        __string(name, name)
+    ),
+    TP_fast_assign(
+        __assign_str(name, name);
+    ),
+    TP_printk("%s", __get_str(name))
+);
+
+#endif /* UART_TRACE_H */
+
+//Must be outside the include guard. The header is not in include/trace/events,
+//so the Makefile adds this directory to the include path
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE uart_trace
+#include <trace/define_trace.h>